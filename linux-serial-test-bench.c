@@ -0,0 +1,346 @@
+// SPDX-License-Identifier: MIT
+
+/*
+ * Microbenchmark for the per-byte kernels of linux-serial-test. The test
+ * program is pulled in as a whole, so the kernels measured here are exactly
+ * the ones the tool runs, on in-memory buffers instead of a serial port.
+ */
+#define _GNU_SOURCE
+#include <sched.h>
+
+#define main linux_serial_test_main
+#include "linux-serial-test.c"
+#undef main
+
+struct bench {
+	const char *name;
+	void (*run)(unsigned char *b, size_t n);
+};
+
+static unsigned char _bench_value;
+static int _bench_null_fd = -1;
+static double _bench_empty_s;	/* cost of one call of an empty kernel */
+
+/* byte at a time versions of the original loops, as a reference */
+static void bench_ref_fill(unsigned char *b, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		b[i] = _bench_value;
+		_bench_value++;
+		if (_cl_ascii_range && _bench_value == 127)
+			_bench_value = 32;
+	}
+}
+
+static void bench_ref_verify(unsigned char *b, size_t n)
+{
+	size_t i;
+
+	_read_count_value = b[0];
+	for (i = 0; i < n; i++) {
+		if (b[i] != _read_count_value) {
+			if (_cl_dump_err)
+				printf("Error\n");
+			_error_count++;
+			if (_cl_stop_on_error)
+				exit(-EIO);
+			_read_count_value = b[i];
+		}
+		_read_count_value++;
+		if (_cl_ascii_range && _read_count_value == 127)
+			_read_count_value = 32;
+	}
+}
+
+static void bench_fill(unsigned char *b, size_t n)
+{
+	_bench_value = pattern_fill(b, n, _bench_value, 0);
+}
+
+static void bench_fill_ascii(unsigned char *b, size_t n)
+{
+	_bench_value = pattern_fill(b, n, _bench_value, 1);
+}
+
+static void bench_verify(unsigned char *b, size_t n)
+{
+	_read_count_value = b[0];
+	rx_kernels[RX_DUMP_NONE][0][0][0](b, n);
+}
+
+static void bench_verify_ascii(unsigned char *b, size_t n)
+{
+	_read_count_value = b[0];
+	rx_kernels[RX_DUMP_NONE][1][0][0](b, n);
+}
+
+static void bench_verify_payload(unsigned char *b, size_t n)
+{
+	_payload_rx_off = 0;
+	rx_kernels[RX_DUMP_NONE][DATA_PAYLOAD][0][0](b, n);
+}
+
+/* ascii data has no 0xff, so the parse leaves the buffer unchanged */
+static void bench_parmrk_ascii(unsigned char *b, size_t n)
+{
+	_parmrk_state = PARMRK_DATA;
+	parmrk_parse(b, n);
+}
+
+/* nothing, to measure the cost of the call and the loop around it */
+static void __attribute__((noinline)) bench_empty(unsigned char *b, size_t n)
+{
+	__asm__ volatile("" : : "r"(b), "r"(n) : "memory");
+}
+
+static void bench_dump_data(unsigned char *b, size_t n)
+{
+	dump_data(b, n);
+}
+
+static void bench_dump_data_ascii(unsigned char *b, size_t n)
+{
+	dump_data_ascii(b, n);
+}
+
+static const struct bench _benches[] = {
+	{ "ref fill (byte loop)", bench_ref_fill },
+	{ "ref verify (byte loop)", bench_ref_verify },
+	{ "tx fill", bench_fill },
+	{ "tx fill ascii", bench_fill_ascii },
+	{ "rx verify", bench_verify },
+	{ "rx verify ascii", bench_verify_ascii },
+	{ "rx verify payload", bench_verify_payload },
+	{ "parmrk scan ascii", bench_parmrk_ascii },
+	{ "dump_data", bench_dump_data },
+	{ "dump_data_ascii", bench_dump_data_ascii },
+};
+
+static int bench_uses_stdout(const struct bench *b)
+{
+	return b->run == bench_dump_data || b->run == bench_dump_data_ascii;
+}
+
+static double bench_now(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static int bench_cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* time a batch of calls, so the clock is read only twice per sample */
+static double bench_batch(const struct bench *b, unsigned char *buf, size_t size, long long int iter)
+{
+	double start = bench_now();
+	long long int i;
+
+	for (i = 0; i < iter; i++)
+		b->run(buf, size);
+
+	return bench_now() - start;
+}
+
+/* number of calls that take about the sample time */
+static long long int bench_calibrate(const struct bench *b, unsigned char *buf, size_t size,
+		double sample_s)
+{
+	long long int iter = 1;
+	double elapsed;
+
+	// grow until the batch is long enough for the clock to be accurate
+	while ((elapsed = bench_batch(b, buf, size, iter)) < sample_s / 10)
+		iter *= 2;
+
+	iter = iter * sample_s / elapsed;
+	return iter > 0 ? iter : 1;
+}
+
+/* time one batch of a kernel, returns ns per byte less the empty call cost */
+static double bench_sample(const struct bench *b, unsigned char *buf, size_t size, long long int iter)
+{
+	double elapsed = bench_batch(b, buf, size, iter) - iter * _bench_empty_s;
+
+	if (elapsed < 0)
+		elapsed = 0;
+	return elapsed * 1e9 / ((double)iter * size);
+}
+
+/* the fastest of several batches of the empty kernel, as overhead only adds */
+static void bench_calibrate_empty(unsigned char *buf, size_t size, double sample_s, int runs)
+{
+	const struct bench empty = { "empty", bench_empty };
+	long long int iter = bench_calibrate(&empty, buf, size, sample_s);
+	double best = 0;
+	int r;
+
+	for (r = 0; r < runs; r++) {
+		double s = bench_batch(&empty, buf, size, iter) / iter;
+
+		if (!r || s < best)
+			best = s;
+	}
+	_bench_empty_s = best;
+}
+
+static void bench_usage(void)
+{
+	printf("Usage: linux-serial-test-bench [OPTION]\n"
+			"\n"
+			"  -h, --help\n"
+			"  -s, --size               Buffer size in bytes (default 1024, the tool's I/O size)\n"
+			"  -r, --runs               Number of samples per kernel (default 15)\n"
+			"  -m, --sample-ms          Length of each sample in ms (default 20)\n"
+			"  -c, --cpu                Pin the benchmark to this CPU\n"
+			"  -f, --filter             Only run kernels whose name contains this string\n"
+			"\n");
+}
+
+int main(int argc, char * argv[])
+{
+	size_t size = 1024;
+	int runs = 15;
+	int sample_ms = 20;
+	int cpu = -1;
+	const char *filter = NULL;
+	unsigned int i;
+	int r;
+
+	for (;;) {
+		static const struct option long_options[] = {
+			{"help", no_argument, 0, 'h'},
+			{"size", required_argument, 0, 's'},
+			{"runs", required_argument, 0, 'r'},
+			{"sample-ms", required_argument, 0, 'm'},
+			{"cpu", required_argument, 0, 'c'},
+			{"filter", required_argument, 0, 'f'},
+			{0,0,0,0},
+		};
+		int c = getopt_long(argc, argv, "hs:r:m:c:f:", long_options, NULL);
+
+		if (c == EOF)
+			break;
+
+		switch (c) {
+		case 's':
+			size = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			runs = atoi(optarg);
+			break;
+		case 'm':
+			sample_ms = atoi(optarg);
+			break;
+		case 'c':
+			cpu = atoi(optarg);
+			break;
+		case 'f':
+			filter = optarg;
+			break;
+		default:
+			bench_usage();
+			exit(c == 'h' ? 0 : -EINVAL);
+		}
+	}
+
+	if (size == 0 || runs <= 0 || sample_ms <= 0) {
+		fprintf(stderr, "ERROR: size, runs and sample-ms must be positive\n");
+		exit(-EINVAL);
+	}
+
+	if (cpu >= 0) {
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+			perror("sched_setaffinity");
+			exit(-errno);
+		}
+	}
+
+	unsigned char *buf = malloc(size);
+	unsigned char *payload = malloc(size);
+	double *samples = malloc(runs * sizeof(*samples));
+
+	if (!buf || !payload || !samples) {
+		fprintf(stderr, "ERROR: Memory allocation failed\n");
+		exit(-ENOMEM);
+	}
+
+	_bench_null_fd = open("/dev/null", O_WRONLY);
+	if (_bench_null_fd < 0) {
+		perror("open /dev/null");
+		exit(-errno);
+	}
+
+	init_pattern_tables();
+
+	/* the payload verifier checks the counting pattern against a copy of it */
+	pattern_fill(payload, size, 0, 0);
+	_payload = payload;
+	_payload_size = size;
+
+	bench_calibrate_empty(buf, size, sample_ms / 1000.0, runs);
+
+	printf("buffer %zu bytes, %d samples of %d ms per kernel, %.2f ns call overhead subtracted\n",
+			size, runs, sample_ms, _bench_empty_s * 1e9);
+	printf("%-24s %10s %10s %10s %10s\n", "kernel", "ns/byte", "min", "max", "GB/s");
+
+	for (i = 0; i < sizeof(_benches) / sizeof(_benches[0]); i++) {
+		const struct bench *b = &_benches[i];
+		int saved_stdout = -1;
+
+		if (filter && !strstr(b->name, filter))
+			continue;
+
+		/* verifiers get an error free stream, as in the steady state */
+		_cl_ascii_range = strstr(b->name, "ascii") != NULL;
+		pattern_fill(buf, size, _cl_ascii_range ? PATTERN_ASCII_FIRST : 0, _cl_ascii_range);
+		_bench_value = _cl_ascii_range ? PATTERN_ASCII_FIRST : 0;
+
+		if (bench_uses_stdout(b)) {
+			fflush(stdout);
+			saved_stdout = dup(STDOUT_FILENO);
+			dup2(_bench_null_fd, STDOUT_FILENO);
+		}
+
+		/* calibrating also warms up caches, branch predictors and the cpu clock */
+		long long int iter = bench_calibrate(b, buf, size, sample_ms / 1000.0);
+
+		for (r = 0; r < runs; r++)
+			samples[r] = bench_sample(b, buf, size, iter);
+
+		if (saved_stdout >= 0) {
+			fflush(stdout);
+			dup2(saved_stdout, STDOUT_FILENO);
+			close(saved_stdout);
+		}
+
+		qsort(samples, runs, sizeof(*samples), bench_cmp);
+
+		double median = samples[runs / 2];
+
+		printf("%-24s %10.3f %10.3f %10.3f %10.3f\n", b->name, median, samples[0],
+				samples[runs - 1], 1.0 / median);
+	}
+
+	if (_error_count)
+		fprintf(stderr, "WARNING: verifier reported %lld errors on a clean stream\n", _error_count);
+
+	close(_bench_null_fd);
+	free(samples);
+	free(payload);
+	free(buf);
+
+	return _error_count ? 1 : 0;
+}
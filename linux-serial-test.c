@@ -1,5 +1,8 @@
 // SPDX-License-Identifier: MIT
 
+// posix_openpt() and friends for --fault-link
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <termios.h>
 #include <unistd.h>
@@ -18,6 +21,17 @@
 #include <errno.h>
 #include <sys/file.h>
 #include <signal.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
 
 /*
  * glibc for MIPS has its own bits/termios.h which does not define
@@ -65,9 +79,9 @@ int _cl_rs485_after_delay = -1;
 int _cl_rs485_before_delay = 0;
 int _cl_rs485_rts_after_send = 0;
 int _cl_do_not_touch_modem_lines = 0;
-int _cl_tx_time = 0;
-int _cl_rx_time = 0;
-int _cl_tx_wait = 0;
+long long int _cl_tx_time_ms = 0;
+long long int _cl_rx_time_ms = 0;
+long long int _cl_tx_wait_ms = 0;
 int _cl_ascii_range = 0;
 int _cl_write_after_read = 0;
 int _cl_rx_timeout_ms = 2000;
@@ -75,6 +89,60 @@ int _cl_tx_timeout_ms = 2000;
 int _cl_error_on_timeout = 0;
 int _cl_no_icount = 0;
 int _cl_flush_buffers = 0;
+int _cl_history = 0;
+char *_cl_metrics_socket = NULL;
+char *_cl_metrics_shm = NULL;
+int _cl_metrics_json = 0;
+int _cl_mark_errors = 0;
+int _cl_ignore_break = 0;
+int _cl_rx_profile = 0;
+char *_cl_payload = NULL;
+long long int _cl_payload_offset = 0;
+int _cl_payload_loop = 0;
+long long int _cl_count = 0;
+int _cl_open_bench = 0;
+char *_cl_baseline_save = NULL;
+char *_cl_baseline_compare = NULL;
+char *_cl_baseline_tolerance = NULL;
+char *_cl_wakeup_sweep = NULL;
+int _cl_perf_counters = 0;
+char *_cl_fault_link = NULL;
+long long int _cl_fault_seed = -1;
+char *_cl_load = NULL;
+char *_cl_load_cpus = NULL;
+long long int _cl_load_step_ms = 0;
+char *_cl_signal_bench = NULL;
+char *_cl_signal_peer = NULL;
+int _cl_signal_count = 100;
+
+// long options without a short equivalent
+enum {
+	OPT_HISTORY = 256,
+	OPT_METRICS_SOCKET,
+	OPT_METRICS_SHM,
+	OPT_METRICS_FORMAT,
+	OPT_MARK_ERRORS,
+	OPT_IGNORE_BREAK,
+	OPT_RX_PROFILE,
+	OPT_PAYLOAD,
+	OPT_PAYLOAD_OFFSET,
+	OPT_PAYLOAD_LOOP,
+	OPT_COUNT,
+	OPT_OPEN_BENCH,
+	OPT_BASELINE_SAVE,
+	OPT_BASELINE_COMPARE,
+	OPT_BASELINE_TOLERANCE,
+	OPT_WAKEUP_SWEEP,
+	OPT_PERF_COUNTERS,
+	OPT_FAULT_LINK,
+	OPT_FAULT_SEED,
+	OPT_LOAD,
+	OPT_LOAD_CPUS,
+	OPT_LOAD_STEP,
+	OPT_SIGNAL_BENCH,
+	OPT_SIGNAL_PEER,
+	OPT_SIGNAL_COUNT,
+};
 
 // Module variables
 unsigned char _write_count_value = 0;
@@ -83,12 +151,32 @@ int _fd = -1;
 unsigned char * _write_data;
 size_t _write_size;
 
+// file payload, used instead of the counting pattern with --payload
+const unsigned char *_payload = NULL;
+size_t _payload_size = 0;
+size_t _payload_tx_off = 0;
+size_t _payload_rx_off = 0;
+
+// set by the TX path once there is nothing left to send
+int _tx_done = 0;
+
 // keep our own counts for cases where the driver stats don't work
 long long int _write_count = 0;
 long long int _read_count = 0;
 long long int _error_count = 0;
+// line errors reported in-band with --mark-errors
+long long int _break_count = 0;
+long long int _line_error_count = 0;
+
+struct timespec _start_time;
+
+static void history_flush(void);
+static void history_dump(void);
+static void metrics_stop(void);
+static void rx_profile_dump(void);
 
 volatile sig_atomic_t sigint_received = 0;
+volatile sig_atomic_t history_dump_requested = 0;
 void sigint_handler(int s)
 {
 	sigint_received += 1;
@@ -99,9 +187,49 @@ void sigint_handler(int s)
 	}
 }
 
+void sigusr1_handler(int s)
+{
+	history_dump_requested = 1;
+}
+
+// SIGUSR2 is only sent between our own threads, to interrupt a blocking call
+static void sigusr2_handler(int s)
+{
+}
+
+static void catch_sigusr2(void)
+{
+	struct sigaction sa;
+
+	// no SA_RESTART, so the signal interrupts a blocked read(), write() or poll()
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sigusr2_handler;
+	sigaction(SIGUSR2, &sa, NULL);
+}
+
+// set *stop, then interrupt the thread until it sets *done on its way out
+static void stop_thread(pthread_t thread, volatile int *stop, volatile int *done)
+{
+	*stop = 1;
+	while (!*done) {
+		pthread_kill(thread, SIGUSR2);
+		usleep(1000);
+	}
+}
+
 static void exit_handler(void)
 {
 	printf("Exit handler: Cleaning up ...\n");
+	if (_cl_history) {
+		history_flush();
+		history_dump();
+	}
+
+	metrics_stop();
+
+	if (_cl_rx_profile)
+		rx_profile_dump();
+
 	tcflush(_fd, TCIOFLUSH);
 
 	if (_fd >= 0) {
@@ -118,6 +246,11 @@ static void exit_handler(void)
 		free(_write_data);
 		_write_data = NULL;
 	}
+
+	if (_payload) {
+		munmap((void *)_payload, _payload_size);
+		_payload = NULL;
+	}
 }
 
 static void dump_data(unsigned char * b, int count)
@@ -139,13 +272,66 @@ static void dump_data_ascii(unsigned char * b, int count)
 	}
 }
 
+/*
+ * Open/configure benchmark (--open-bench). The setup functions mark the end
+ * of each step and the time since the previous mark is added to that step.
+ * Outside of the benchmark _open_step_ns is NULL and the marks do nothing.
+ */
+enum {
+	STEP_OPEN,
+	STEP_FLOCK,
+	STEP_TCFLUSH,
+	STEP_TCSETATTR,
+	STEP_GET_RS485,
+	STEP_SET_RS485,
+	STEP_GET_SERIAL,
+	STEP_SET_SERIAL,
+	STEP_MODEM_LINES,
+	STEP_CONFIGURED,	/* from open() to configured */
+	STEP_FIRST_BYTE,	/* from open() to first byte received */
+	STEP_CLOSE,
+	OPEN_STEPS,
+};
+
+static const char * const open_step_names[OPEN_STEPS] = {
+	"open", "flock", "tcflush", "tcsetattr", "TIOCGRS485", "TIOCSRS485", "TIOCGSERIAL",
+	"TIOCSSERIAL", "TIOCMGET/TIOCMSET", "configured", "first byte", "close",
+};
+
+static double *_open_step_ns = NULL;
+static struct timespec _open_step_last;
+
+static void open_step_begin(void)
+{
+	if (_open_step_ns)
+		clock_gettime(CLOCK_MONOTONIC, &_open_step_last);
+}
+
+static void open_step_done(int step)
+{
+	struct timespec now;
+
+	if (!_open_step_ns)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	// steps start out as -1, meaning not done in this iteration
+	if (_open_step_ns[step] < 0)
+		_open_step_ns[step] = 0;
+	_open_step_ns[step] += (now.tv_sec - _open_step_last.tv_sec) * 1e9 +
+		(now.tv_nsec - _open_step_last.tv_nsec);
+	_open_step_last = now;
+}
+
 static void set_baud_divisor(int speed, int custom_divisor)
 {
 	// default baud was not found, so try to set a custom divisor
 	struct serial_struct ss;
 	int ret;
 
-	if (ioctl(_fd, TIOCGSERIAL, &ss) < 0) {
+	ret = ioctl(_fd, TIOCGSERIAL, &ss);
+	open_step_done(STEP_GET_SERIAL);
+	if (ret < 0) {
 		ret = -errno;
 		perror("TIOCGSERIAL failed");
 		exit(ret);
@@ -167,7 +353,10 @@ static void set_baud_divisor(int speed, int custom_divisor)
 				ss.custom_divisor);
 	}
 
-	if (ioctl(_fd, TIOCSSERIAL, &ss) < 0) {
+	open_step_begin();
+	ret = ioctl(_fd, TIOCSSERIAL, &ss);
+	open_step_done(STEP_SET_SERIAL);
+	if (ret < 0) {
 		ret = -errno;
 		perror("TIOCSSERIAL failed");
 		exit(ret);
@@ -179,7 +368,9 @@ static void clear_custom_speed_flag()
 	struct serial_struct ss;
 	int ret;
 
-	if (ioctl(_fd, TIOCGSERIAL, &ss) < 0) {
+	ret = ioctl(_fd, TIOCGSERIAL, &ss);
+	open_step_done(STEP_GET_SERIAL);
+	if (ret < 0) {
 		// return silently as some devices do not support TIOCGSERIAL
 		return;
 	}
@@ -189,7 +380,9 @@ static void clear_custom_speed_flag()
 
 	ss.flags &= ~ASYNC_SPD_MASK;
 
-	if (ioctl(_fd, TIOCSSERIAL, &ss) < 0) {
+	ret = ioctl(_fd, TIOCSSERIAL, &ss);
+	open_step_done(STEP_SET_SERIAL);
+	if (ret < 0) {
 		ret = -errno;
 		perror("TIOCSSERIAL failed");
 		exit(ret);
@@ -283,6 +476,7 @@ void set_modem_lines(int fd, int bits, int mask)
 		perror("TIOCMSET failed");
 		exit(ret);
 	}
+	open_step_done(STEP_MODEM_LINES);
 }
 
 static void display_help(void)
@@ -322,18 +516,86 @@ static void display_help(void)
 			"  -Q, --rs485_rts          Deassert RTS on send, assert after send. Omitting -Q inverts this logic.\n"
 			"  -m, --no-modem           Do not clobber against any modem lines.\n"
 			"  -o, --tx-time            Number of seconds to transmit for (defaults to 0, meaning no limit)\n"
+			"                           Fractions and an 'ms' suffix are allowed (-o 0.5, -o 250ms)\n"
 			"  -i, --rx-time            Number of seconds to receive for (defaults to 0, meaning no limit)\n"
+			"                           Fractions and an 'ms' suffix are allowed (-i 1.5, -i 500ms)\n"
 			"  -A, --ascii              Output bytes range from 32 to 126 (default is 0 to 255)\n"
 			"  -I, --rx-timeout         Receive timeout\n"
 			"  -O, --tx-timeout         Transmission timeout\n"
 			"  -W, --tx-wait            Number of seconds to wait before to transmit (defaults to 0, meaning no wait)\n"
+			"                           Fractions and an 'ms' suffix are allowed (-W 0.2, -W 200ms)\n"
+			"      --count              Transmit exactly this many bytes, and stop receiving once this many\n"
+			"                           bytes have been received and checked\n"
+			"      --open-bench         Open, configure and close the port this many times and report how\n"
+			"                           long each step and the first received byte take. -p can list several\n"
+			"                           ports separated by commas, which are tested in parallel\n"
+			"      --baseline-save      Save the throughput, CPU per byte and (with --rx-profile) latency of\n"
+			"                           this run to a file. If there were no data errors the exit status\n"
+			"                           is 203 if the file cannot be written\n"
+			"      --baseline-compare   Compare this run with a saved baseline. If there were no data errors\n"
+			"                           (exit status 0-125) the exit status is 200 if a metric is worse than\n"
+			"                           its tolerance, 201 if the file cannot be read and 202 if a metric in\n"
+			"                           it was not measured\n"
+			"      --baseline-tolerance Allowed change in percent (default 5), optionally per metric:\n"
+			"                           10,cpu_ns_per_byte=20\n"
+			"      --wakeup-sweep       Receive the same traffic (-w byte bursts every -a ms, default 16\n"
+			"                           bytes every 10ms, for -o seconds, default 2) with several read\n"
+			"                           policies and print CPU use, wakeups/s and latency for each. An\n"
+			"                           optional list selects the policies (default\n"
+			"                           block:1:0,block:32:1,block:128:5,poll,busy,timer:1,timer:10)\n"
 			"  -Z, --error-on-timeout   Treat timeouts as errors\n"
 			"  -n, --no-icount          Do not request driver for counts of input serial line interrupts (TIOCGICOUNT)\n"
 			"  -f, --flush-buffers      Flush RX and TX buffers before starting\n"
+			"      --perf-counters      Count cycles, instructions, cache misses, context switches and CPU\n"
+			"                           time of the I/O loop with perf_event_open, split into RX, TX and the\n"
+			"                           rest of the loop, and report them per MB at exit\n"
+			"      --fault-link         Test against a built-in loopback on a pseudo-terminal (instead of -p)\n"
+			"                           that injects faults, e.g. drop=1e-5,flip=1e-5,insert=1e-5,\n"
+			"                           delay=1e-6:20,stall=1e-6:100,rate=100000 (per byte probabilities,\n"
+			"                           ms, bytes/s). The exit status is 0 if the errors found match the\n"
+			"                           injected faults\n"
+			"      --fault-seed         Seed for --fault-link (default is random, and printed)\n"
+			"      --load               Run background load threads during the test: cpu=N (spin),\n"
+			"                           mem=N (memcpy bandwidth), cache=N (cache thrashing), e.g. cpu=4,mem=1\n"
+			"      --load-cpus          Pin the load threads to these CPUs in turn, e.g. 2,3\n"
+			"      --load-step          Ramp the load up from none, one more thread of each kind every this\n"
+			"                           many seconds, and stop when all run. Reports each level\n"
+			"      --signal-bench       Toggle a modem line or send breaks at increasing rates and report the\n"
+			"                           highest rate the peer sees every event at, with latencies: rts (seen\n"
+			"                           as CTS), dtr (seen as DSR), dcd (DTR seen as DCD) or break\n"
+			"      --signal-peer        Port that watches the events (default is -p, for a loopback plug)\n"
+			"      --signal-count       Events per rate (default 100)\n"
+			"      --history            Keep a fixed-size history of per-interval rx/tx/error/icount deltas at\n"
+			"                           1s, 1min and 1h resolution, dumped on SIGUSR1 and at exit\n"
+			"      --metrics-socket     Serve live counters on this Unix domain socket path. Each connection\n"
+			"                           gets one snapshot. With -s the 5s stats are also printed from the\n"
+			"                           reporter thread instead of the I/O loop\n"
+			"      --metrics-shm        Keep the live counters in this POSIX shared memory object (/name)\n"
+			"      --metrics-format     Format for --metrics-socket (prometheus, json) (prometheus is default)\n"
+			"      --mark-errors        Enable INPCK/PARMRK and report each parity, framing and break error\n"
+			"                           with its stream offset and time (shown with -e)\n"
+			"      --ignore-break       Set IGNBRK, the driver drops breaks instead of marking them\n"
+			"      --rx-profile         Timestamp every read and report histograms of read sizes and of the\n"
+			"                           time between reads, with the buffering delay this implies, at exit\n"
+			"      --payload            Send the contents of this file instead of the counting pattern, and\n"
+			"                           check received data against it\n"
+			"      --payload-offset     Start sending and checking at this offset in the payload file\n"
+			"      --payload-loop       Restart at the beginning of the payload file when the end is reached\n"
 			"\n"
 		);
 }
 
+// parses a duration in seconds, with an optional "s" or "ms" suffix, into ms
+static long long int parse_duration_ms(const char *arg)
+{
+	char *endptr;
+	double v = strtod(arg, &endptr);
+
+	if (!strcmp(endptr, "ms"))
+		return v + 0.5;
+	return v * 1000 + 0.5;
+}
+
 static void process_options(int argc, char * argv[])
 {
 	for (;;) {
@@ -374,6 +636,31 @@ static void process_options(int argc, char * argv[])
 			{"error-on-timeout", no_argument, 0, 'Z'},
 			{"no-icount", no_argument, 0, 'n'},
 			{"flush-buffers", no_argument, 0, 'f'},
+			{"history", no_argument, 0, OPT_HISTORY},
+			{"metrics-socket", required_argument, 0, OPT_METRICS_SOCKET},
+			{"metrics-shm", required_argument, 0, OPT_METRICS_SHM},
+			{"metrics-format", required_argument, 0, OPT_METRICS_FORMAT},
+			{"mark-errors", no_argument, 0, OPT_MARK_ERRORS},
+			{"ignore-break", no_argument, 0, OPT_IGNORE_BREAK},
+			{"rx-profile", no_argument, 0, OPT_RX_PROFILE},
+			{"payload", required_argument, 0, OPT_PAYLOAD},
+			{"payload-offset", required_argument, 0, OPT_PAYLOAD_OFFSET},
+			{"payload-loop", no_argument, 0, OPT_PAYLOAD_LOOP},
+			{"count", required_argument, 0, OPT_COUNT},
+			{"open-bench", required_argument, 0, OPT_OPEN_BENCH},
+			{"baseline-save", required_argument, 0, OPT_BASELINE_SAVE},
+			{"baseline-compare", required_argument, 0, OPT_BASELINE_COMPARE},
+			{"baseline-tolerance", required_argument, 0, OPT_BASELINE_TOLERANCE},
+			{"wakeup-sweep", optional_argument, 0, OPT_WAKEUP_SWEEP},
+			{"perf-counters", no_argument, 0, OPT_PERF_COUNTERS},
+			{"fault-link", required_argument, 0, OPT_FAULT_LINK},
+			{"fault-seed", required_argument, 0, OPT_FAULT_SEED},
+			{"load", required_argument, 0, OPT_LOAD},
+			{"load-cpus", required_argument, 0, OPT_LOAD_CPUS},
+			{"load-step", required_argument, 0, OPT_LOAD_STEP},
+			{"signal-bench", required_argument, 0, OPT_SIGNAL_BENCH},
+			{"signal-peer", required_argument, 0, OPT_SIGNAL_PEER},
+			{"signal-count", required_argument, 0, OPT_SIGNAL_COUNT},
 			{0,0,0,0},
 		};
 
@@ -485,21 +772,15 @@ static void process_options(int argc, char * argv[])
 		case 'm':
 			_cl_do_not_touch_modem_lines = 1;
 			break;
-		case 'o': {
-			char *endptr;
-			_cl_tx_time = strtol(optarg, &endptr, 0);
+		case 'o':
+			_cl_tx_time_ms = parse_duration_ms(optarg);
 			break;
-		}
-		case 'i': {
-			char *endptr;
-			_cl_rx_time = strtol(optarg, &endptr, 0);
+		case 'i':
+			_cl_rx_time_ms = parse_duration_ms(optarg);
 			break;
-		}
-		case 'W': {
-			char *endptr;
-			_cl_tx_wait = strtol(optarg, &endptr, 0);
+		case 'W':
+			_cl_tx_wait_ms = parse_duration_ms(optarg);
 			break;
-		}
 		case 'A':
 			_cl_ascii_range = 1;
 			break;
@@ -518,6 +799,88 @@ static void process_options(int argc, char * argv[])
 		case 'f':
 			_cl_flush_buffers = 1;
 			break;
+		case OPT_HISTORY:
+			_cl_history = 1;
+			break;
+		case OPT_METRICS_SOCKET:
+			_cl_metrics_socket = strdup(optarg);
+			break;
+		case OPT_METRICS_SHM:
+			_cl_metrics_shm = strdup(optarg);
+			break;
+		case OPT_METRICS_FORMAT:
+			if (!strcmp(optarg, "json")) {
+				_cl_metrics_json = 1;
+			} else if (!strcmp(optarg, "prometheus")) {
+				_cl_metrics_json = 0;
+			} else {
+				fprintf(stderr, "ERROR: unknown metrics format %s, use prometheus or json\n", optarg);
+				exit(-EINVAL);
+			}
+			break;
+		case OPT_MARK_ERRORS:
+			_cl_mark_errors = 1;
+			break;
+		case OPT_IGNORE_BREAK:
+			_cl_ignore_break = 1;
+			break;
+		case OPT_RX_PROFILE:
+			_cl_rx_profile = 1;
+			break;
+		case OPT_PAYLOAD:
+			_cl_payload = strdup(optarg);
+			break;
+		case OPT_PAYLOAD_OFFSET:
+			_cl_payload_offset = strtoll(optarg, NULL, 0);
+			break;
+		case OPT_PAYLOAD_LOOP:
+			_cl_payload_loop = 1;
+			break;
+		case OPT_COUNT:
+			_cl_count = strtoll(optarg, NULL, 0);
+			break;
+		case OPT_OPEN_BENCH:
+			_cl_open_bench = atoi(optarg);
+			break;
+		case OPT_BASELINE_SAVE:
+			_cl_baseline_save = strdup(optarg);
+			break;
+		case OPT_BASELINE_COMPARE:
+			_cl_baseline_compare = strdup(optarg);
+			break;
+		case OPT_BASELINE_TOLERANCE:
+			_cl_baseline_tolerance = strdup(optarg);
+			break;
+		case OPT_WAKEUP_SWEEP:
+			_cl_wakeup_sweep = strdup(optarg ? optarg : "");
+			break;
+		case OPT_PERF_COUNTERS:
+			_cl_perf_counters = 1;
+			break;
+		case OPT_FAULT_LINK:
+			_cl_fault_link = strdup(optarg);
+			break;
+		case OPT_FAULT_SEED:
+			_cl_fault_seed = strtoll(optarg, NULL, 0);
+			break;
+		case OPT_LOAD:
+			_cl_load = strdup(optarg);
+			break;
+		case OPT_LOAD_CPUS:
+			_cl_load_cpus = strdup(optarg);
+			break;
+		case OPT_LOAD_STEP:
+			_cl_load_step_ms = parse_duration_ms(optarg);
+			break;
+		case OPT_SIGNAL_BENCH:
+			_cl_signal_bench = strdup(optarg);
+			break;
+		case OPT_SIGNAL_PEER:
+			_cl_signal_peer = strdup(optarg);
+			break;
+		case OPT_SIGNAL_COUNT:
+			_cl_signal_count = atoi(optarg);
+			break;
 		}
 	}
 }
@@ -527,6 +890,8 @@ static void dump_serial_port_stats(void)
 	struct serial_icounter_struct icount = { 0 };
 
 	printf("%s: count for this session: rx=%lld, tx=%lld, rx err=%lld\n", _cl_port, _read_count, _write_count, _error_count);
+	if (_cl_mark_errors)
+		printf("%s: marked line errors: parity/frame=%lld, brk=%lld\n", _cl_port, _line_error_count, _break_count);
 
 	if (!_cl_no_icount) {
 		int ret = ioctl(_fd, TIOCGICOUNT, &icount);
@@ -540,72 +905,393 @@ static void dump_serial_port_stats(void)
 	}
 }
 
-static unsigned char next_count_value(unsigned char c)
+/*
+ * Counting pattern tables. Each table holds two periods of the pattern, so
+ * a run of up to one period starting at any pattern value can be produced
+ * or checked with a single memcpy()/memcmp().
+ */
+#define PATTERN_FULL_FIRST	0
+#define PATTERN_FULL_PERIOD	256
+#define PATTERN_ASCII_FIRST	32
+#define PATTERN_ASCII_PERIOD	95
+
+static unsigned char _pattern_full[2 * PATTERN_FULL_PERIOD];
+static unsigned char _pattern_ascii[2 * PATTERN_ASCII_PERIOD];
+
+static void init_pattern_tables(void)
+{
+	int i;
+
+	for (i = 0; i < 2 * PATTERN_FULL_PERIOD; i++)
+		_pattern_full[i] = PATTERN_FULL_FIRST + i % PATTERN_FULL_PERIOD;
+	for (i = 0; i < 2 * PATTERN_ASCII_PERIOD; i++)
+		_pattern_ascii[i] = PATTERN_ASCII_FIRST + i % PATTERN_ASCII_PERIOD;
+}
+
+/*
+ * The kernels below are written once with their options as parameters and
+ * always inlined into one variant per option combination, so the options
+ * are compile time constants inside each variant and the per-byte loops
+ * carry no option checks. The variants are picked once by select_kernels().
+ */
+#define KERNEL static inline __attribute__((always_inline))
+
+KERNEL unsigned char next_count_value(unsigned char c, const int ascii)
 {
 	c++;
-	if (_cl_ascii_range && c == 127)
-		c = 32;
+	if (ascii && c == PATTERN_ASCII_FIRST + PATTERN_ASCII_PERIOD)
+		c = PATTERN_ASCII_FIRST;
 	return c;
 }
 
-static void process_read_data(void)
+KERNEL int pattern_in_range(unsigned char c, const int ascii)
 {
-	unsigned char rb[1024];
-	int loopcounter = 0;
-	int actual_read_count = 0;
-	int expected_read_count = _cl_tx_bytes == 0 ? 1024 : _cl_tx_bytes;
-	/* time for one char at current baudrate in us */
-	int chartime = 1000000 * (8 + _cl_parity + 1 + _cl_2_stop_bit) / _cl_baud;
+	if (!ascii)
+		return 1;
+	return c >= PATTERN_ASCII_FIRST && c < PATTERN_ASCII_FIRST + PATTERN_ASCII_PERIOD;
+}
 
-	while (actual_read_count < expected_read_count) {
-		int c = read(_fd, &rb, sizeof(rb));
-		if (c > 0) {
-			if (_cl_rx_dump) {
-				if (_cl_rx_dump_ascii)
-					dump_data_ascii(rb, c);
-				else
-					dump_data(rb, c);
-			}
-
-			// verify read count is incrementing
-			int i;
-			for (i = 0; i < c; i++) {
-				if (rb[i] != _read_count_value) {
-					if (_cl_dump_err) {
-						printf("Error, count: %lld, expected %02x, got %02x c %x\n",
-							_read_count + i, _read_count_value, rb[i], c);
+// fill b with the counting pattern starting at v, returns the next value
+KERNEL unsigned char pattern_fill(unsigned char *b, size_t n, unsigned char v, const int ascii)
+{
+	const unsigned char *table = ascii ? _pattern_ascii : _pattern_full;
+	const size_t first = ascii ? PATTERN_ASCII_FIRST : PATTERN_FULL_FIRST;
+	const size_t period = ascii ? PATTERN_ASCII_PERIOD : PATTERN_FULL_PERIOD;
+
+	while (n) {
+		if (!pattern_in_range(v, ascii)) {
+			*b++ = v;
+			v = next_count_value(v, ascii);
+			n--;
+			continue;
+		}
+
+		size_t chunk = n < period ? n : period;
+		size_t idx = v - first;
+
+		memcpy(b, table + idx, chunk);
+		v = table[idx + chunk];
+		b += chunk;
+		n -= chunk;
+	}
+
+	return v;
+}
+
+/*
+ * Classification of counting pattern errors. pattern_verify() resyncs on
+ * every mismatch, so each kind of fault leaves its own footprint:
+ *  - lost bytes: one error, the stream continues after the received value
+ *  - a changed byte: an error, then the stream continues after the value
+ *    that was expected (the resync point was wrong), a second error
+ *  - an extra byte: an error, then the expected value itself, a second error
+ * An error is kept pending until the next byte shows which one it was.
+ */
+long long int _class_lost = 0;		/* events */
+long long int _class_lost_bytes = 0;
+long long int _class_bit_flips = 0;	/* changed in one bit */
+long long int _class_corrupt = 0;	/* changed in more bits */
+long long int _class_inserted = 0;
+long long int _class_other = 0;
+
+static long long int _class_pending_off = -1;
+static unsigned char _class_pending_expected;
+static unsigned char _class_pending_got;
+
+// resolve a pending error that was not followed by a second one
+static void error_class_flush(long long int next_off)
+{
+	int ascii = _cl_ascii_range;
+	unsigned char v = _class_pending_expected;
+	int lost = 0;
+
+	if (_class_pending_off < 0 || next_off <= _class_pending_off + 1)
+		return;
+
+	while (v != _class_pending_got && lost < PATTERN_FULL_PERIOD) {
+		v = next_count_value(v, ascii);
+		lost++;
+	}
+	if (lost < PATTERN_FULL_PERIOD) {
+		_class_lost++;
+		_class_lost_bytes += lost;
+	} else {
+		// a value outside the pattern, e.g. out of the ascii range
+		_class_other++;
+	}
+	_class_pending_off = -1;
+}
+
+static void error_classify(long long int off, unsigned char expected, unsigned char got)
+{
+	int ascii = _cl_ascii_range;
+
+	if (_class_pending_off >= 0 && off == _class_pending_off + 1) {
+		unsigned char diff = _class_pending_expected ^ _class_pending_got;
+
+		if (got == _class_pending_expected) {
+			_class_inserted++;
+			_class_pending_off = -1;
+			return;
+		}
+		if (got == next_count_value(_class_pending_expected, ascii)) {
+			if (!(diff & (diff - 1)))
+				_class_bit_flips++;
+			else
+				_class_corrupt++;
+			_class_pending_off = -1;
+			return;
+		}
+		// a burst of garbage, start over at this byte
+		_class_other++;
+		_class_pending_off = -1;
+	}
+
+	error_class_flush(off);
+	_class_pending_off = off;
+	_class_pending_expected = expected;
+	_class_pending_got = got;
+}
+
+static void error_class_print(void)
+{
+	error_class_flush(_read_count);
+	printf("%s: error classes: lost=%lld (%lld bytes), bit flips=%lld, corrupt=%lld, inserted=%lld, other=%lld%s\n",
+			_cl_port, _class_lost, _class_lost_bytes, _class_bit_flips, _class_corrupt, _class_inserted,
+			_class_other, _class_pending_off >= 0 ? ", 1 unresolved at the end" : "");
+}
+
+// verify that rb continues the counting pattern, resyncing on errors
+KERNEL void pattern_verify(const unsigned char *rb, int c, const int ascii, const int dump_err,
+		const int stop_on_error)
+{
+	const unsigned char *table = ascii ? _pattern_ascii : _pattern_full;
+	const int first = ascii ? PATTERN_ASCII_FIRST : PATTERN_FULL_FIRST;
+	const int period = ascii ? PATTERN_ASCII_PERIOD : PATTERN_FULL_PERIOD;
+	unsigned char v = _read_count_value;
+	int i = 0;
+
+	while (i < c) {
+		if (pattern_in_range(v, ascii)) {
+			int chunk = c - i < period ? c - i : period;
+			int idx = v - first;
+
+			if (memcmp(rb + i, table + idx, chunk) == 0) {
+				v = table[idx + chunk];
+				i += chunk;
+				continue;
+			}
+
+			// there is a mismatch in this chunk, skip to it
+			while (rb[i] == v) {
+				v = next_count_value(v, ascii);
+				i++;
+			}
+		}
+
+		if (rb[i] != v) {
+			if (dump_err) {
+				printf("Error, count: %lld, expected %02x, got %02x c %x\n",
+					_read_count + i, v, rb[i], c);
+			}
+			_error_count++;
+			error_classify(_read_count + i, v, rb[i]);
+			if (stop_on_error) {
+				dump_serial_port_stats();
+				exit(-EIO);
+			}
+			v = rb[i];
+		}
+		v = next_count_value(v, ascii);
+		i++;
+	}
+
+	_read_count_value = v;
+}
+
+/*
+ * Received data is checked against the payload file byte for byte, and
+ * each differing byte is an error. Unlike the counting pattern a single
+ * received value does not tell where in the payload it belongs, so after
+ * a mismatch the next PAYLOAD_SYNC_LEN received bytes are collected. If
+ * most of them differ, sync was lost (bytes were lost or added) and the
+ * collected bytes are searched for in the payload within
+ * PAYLOAD_SYNC_WINDOW bytes of where they were expected; checking goes on
+ * from where they are found. A lost or extra byte thus costs at most about
+ * PAYLOAD_SYNC_LEN errors instead of every byte after it.
+ */
+#define PAYLOAD_SYNC_LEN	16
+#define PAYLOAD_SYNC_WINDOW	4096
+
+static unsigned char _payload_sync_buf[PAYLOAD_SYNC_LEN];
+static int _payload_sync_len = 0;	/* bytes collected, 0 when in sync */
+static int _payload_sync_bad = 0;
+static size_t _payload_sync_off;	/* payload offset of the first collected byte */
+
+// collect a byte after a mismatch, returns 1 and sets *next on a resync
+static int payload_sync(unsigned char b, size_t off, int bad, size_t *next)
+{
+	size_t d, lo, hi;
+
+	if (_payload_sync_len == 0)
+		_payload_sync_off = off;
+	_payload_sync_buf[_payload_sync_len++] = b;
+	_payload_sync_bad += bad;
+	if (_payload_sync_len < PAYLOAD_SYNC_LEN)
+		return 0;
+
+	_payload_sync_len = 0;
+	// a few changed bytes, sync is fine
+	if (_payload_sync_bad * 2 < PAYLOAD_SYNC_LEN) {
+		_payload_sync_bad = 0;
+		return 0;
+	}
+	_payload_sync_bad = 0;
+
+	if (_payload_size < PAYLOAD_SYNC_LEN)
+		return 0;
+	lo = _payload_sync_off > PAYLOAD_SYNC_WINDOW ? _payload_sync_off - PAYLOAD_SYNC_WINDOW : 0;
+	hi = _payload_size - PAYLOAD_SYNC_LEN;
+	if (hi > _payload_sync_off + PAYLOAD_SYNC_WINDOW)
+		hi = _payload_sync_off + PAYLOAD_SYNC_WINDOW;
+
+	// nearest match first
+	for (d = 0; d <= PAYLOAD_SYNC_WINDOW; d++) {
+		if (_payload_sync_off + d <= hi &&
+				!memcmp(_payload + _payload_sync_off + d, _payload_sync_buf, PAYLOAD_SYNC_LEN)) {
+			*next = _payload_sync_off + d + PAYLOAD_SYNC_LEN;
+			return 1;
+		}
+		if (d && _payload_sync_off >= lo + d &&
+				!memcmp(_payload + _payload_sync_off - d, _payload_sync_buf, PAYLOAD_SYNC_LEN)) {
+			*next = _payload_sync_off - d + PAYLOAD_SYNC_LEN;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+KERNEL void payload_verify(const unsigned char *rb, int c, const int dump_err, const int stop_on_error)
+{
+	size_t off = _payload_rx_off;
+	int i = 0;
+
+	while (i < c) {
+		if (off == _payload_size) {
+			if (!_cl_payload_loop) {
+				for (; i < c; i++) {
+					if (dump_err) {
+						printf("Error, count: %lld, got %02x after end of payload c %x\n",
+							_read_count + i, rb[i], c);
 					}
 					_error_count++;
-					if (_cl_stop_on_error) {
+					if (stop_on_error) {
 						dump_serial_port_stats();
 						exit(-EIO);
 					}
-					_read_count_value = rb[i];
 				}
-				_read_count_value = next_count_value(_read_count_value);
-			}
-			_read_count += c;
-			actual_read_count += c;
-		} else if (errno) {
-			if (errno != EAGAIN) {
-				perror("read failed");
+				break;
 			}
+			off = 0;
+		}
 
-			if (loopcounter++ < expected_read_count) {
-				usleep(chartime);
-				continue; // Retry the read
+		int chunk = _payload_size - off < c - i ? _payload_size - off : c - i;
+
+		if (!_payload_sync_len && memcmp(rb + i, _payload + off, chunk) == 0) {
+			i += chunk;
+			off += chunk;
+			continue;
+		}
+
+		for (; chunk; chunk--, i++, off++) {
+			int bad = rb[i] != _payload[off];
+
+			if (bad) {
+				if (dump_err) {
+					printf("Error, count: %lld, expected %02x, got %02x c %x\n",
+						_read_count + i, _payload[off], rb[i], c);
+				}
+				_error_count++;
+				if (stop_on_error) {
+					dump_serial_port_stats();
+					exit(-EIO);
+				}
+			}
+			if ((bad || _payload_sync_len) && payload_sync(rb[i], off, bad, &off)) {
+				if (dump_err)
+					printf("Resync, count: %lld, at payload offset %zu\n", _read_count + i + 1, off);
+				i++;
+				break;
 			}
-			break;
-		} else {
-		    break;
 		}
 	}
-	if (_cl_rx_detailed) {
-		printf("Read %d bytes\n", actual_read_count);
-	}
+
+	_payload_rx_off = off;
+}
+
+// where transmitted data comes from and received data is checked against
+enum {
+	DATA_COUNT,
+	DATA_ASCII,
+	DATA_PAYLOAD,
+};
+
+enum {
+	RX_DUMP_NONE,
+	RX_DUMP_HEX,
+	RX_DUMP_ASCII,
+};
+
+KERNEL void rx_chunk(unsigned char *rb, int c, const int dump, const int source, const int dump_err,
+		const int stop_on_error)
+{
+	if (dump == RX_DUMP_HEX)
+		dump_data(rb, c);
+	else if (dump == RX_DUMP_ASCII)
+		dump_data_ascii(rb, c);
+
+	if (source == DATA_PAYLOAD)
+		payload_verify(rb, c, dump_err, stop_on_error);
+	else
+		pattern_verify(rb, c, source == DATA_ASCII, dump_err, stop_on_error);
 }
 
-static void process_write_data(void)
+typedef void (*rx_kernel_fn)(unsigned char *rb, int c);
+
+#define RX_KERNEL(dump, source, err, stop) \
+	static void rx_kernel_##dump##source##err##stop(unsigned char *rb, int c) \
+	{ \
+		rx_chunk(rb, c, dump, source, err, stop); \
+	}
+
+#define RX_KERNELS(dump) \
+	RX_KERNEL(dump, 0, 0, 0) RX_KERNEL(dump, 0, 0, 1) \
+	RX_KERNEL(dump, 0, 1, 0) RX_KERNEL(dump, 0, 1, 1) \
+	RX_KERNEL(dump, 1, 0, 0) RX_KERNEL(dump, 1, 0, 1) \
+	RX_KERNEL(dump, 1, 1, 0) RX_KERNEL(dump, 1, 1, 1) \
+	RX_KERNEL(dump, 2, 0, 0) RX_KERNEL(dump, 2, 0, 1) \
+	RX_KERNEL(dump, 2, 1, 0) RX_KERNEL(dump, 2, 1, 1)
+
+RX_KERNELS(0)
+RX_KERNELS(1)
+RX_KERNELS(2)
+
+#define RX_KERNEL_ROW(dump) { \
+	{ { rx_kernel_##dump##000, rx_kernel_##dump##001 }, \
+	  { rx_kernel_##dump##010, rx_kernel_##dump##011 } }, \
+	{ { rx_kernel_##dump##100, rx_kernel_##dump##101 }, \
+	  { rx_kernel_##dump##110, rx_kernel_##dump##111 } }, \
+	{ { rx_kernel_##dump##200, rx_kernel_##dump##201 }, \
+	  { rx_kernel_##dump##210, rx_kernel_##dump##211 } } }
+
+// indexed by [rx dump][data source][dump errors][stop on error]
+static const rx_kernel_fn rx_kernels[3][3][2][2] = {
+	RX_KERNEL_ROW(0),
+	RX_KERNEL_ROW(1),
+	RX_KERNEL_ROW(2),
+};
+
+KERNEL void tx_write(const int write_after_read, const int source)
 {
 	ssize_t count = 0;
 	size_t actual_write_size = 0;
@@ -613,7 +1299,7 @@ static void process_write_data(void)
 
 	do
 	{
-		if (_cl_write_after_read == 0) {
+		if (write_after_read == 0) {
 			actual_write_size = _write_size;
 		} else {
 			actual_write_size = _read_count > _write_count ? _read_count - _write_count : 0;
@@ -621,17 +1307,40 @@ static void process_write_data(void)
 				actual_write_size = _write_size;
 			}
 		}
+		if (_cl_count) {
+			long long int left = _cl_count - _write_count - count;
+
+			if (left <= 0) {
+				_tx_done = 1;
+				break;
+			}
+			if (actual_write_size > left)
+				actual_write_size = left;
+		}
 		if (actual_write_size == 0) {
 			break;
 		}
 
-		ssize_t i;
-		for (i = 0; i < actual_write_size; i++) {
-			_write_data[i] = _write_count_value;
-			_write_count_value = next_count_value(_write_count_value);
+		const unsigned char *data = _write_data;
+
+		if (source == DATA_PAYLOAD) {
+			if (_payload_tx_off == _payload_size) {
+				if (!_cl_payload_loop) {
+					_tx_done = 1;
+					break;
+				}
+				_payload_tx_off = 0;
+			}
+			if (actual_write_size > _payload_size - _payload_tx_off)
+				actual_write_size = _payload_size - _payload_tx_off;
+			// written straight from the mapping, no copy
+			data = _payload + _payload_tx_off;
+		} else {
+			_write_count_value = pattern_fill(_write_data, actual_write_size, _write_count_value,
+					source == DATA_ASCII);
 		}
 
-		ssize_t c = write(_fd, _write_data, actual_write_size);
+		ssize_t c = write(_fd, data, actual_write_size);
 
 		if (c < 0) {
 			if (errno != EAGAIN) {
@@ -642,8 +1351,12 @@ static void process_write_data(void)
 
 		count += c;
 
+		if (source == DATA_PAYLOAD)
+			_payload_tx_off += c;
+
 		if (c < actual_write_size) {
-			_write_count_value = _write_data[c];
+			if (source != DATA_PAYLOAD)
+				_write_count_value = _write_data[c];
 			repeat = 0;
 		}
 	} while (repeat);
@@ -654,121 +1367,3136 @@ static void process_write_data(void)
 		printf("wrote %zd bytes\n", count);
 }
 
+typedef void (*tx_kernel_fn)(void);
 
-static void setup_serial_port(int baud)
+#define TX_KERNEL(war, source) \
+	static void tx_kernel_##war##source(void) \
+	{ \
+		tx_write(war, source); \
+	}
+
+TX_KERNEL(0, 0)
+TX_KERNEL(0, 1)
+TX_KERNEL(0, 2)
+TX_KERNEL(1, 0)
+TX_KERNEL(1, 1)
+TX_KERNEL(1, 2)
+
+// indexed by [write after read][data source]
+static const tx_kernel_fn tx_kernels[2][3] = {
+	{ tx_kernel_00, tx_kernel_01, tx_kernel_02 },
+	{ tx_kernel_10, tx_kernel_11, tx_kernel_12 },
+};
+
+static rx_kernel_fn _rx_kernel = rx_kernel_0000;
+static tx_kernel_fn _tx_kernel = tx_kernel_00;
+
+static void select_kernels(void)
 {
-	struct termios newtio;
-	struct serial_rs485 rs485;
-	int ret;
+	int dump = RX_DUMP_NONE;
+	int source = _cl_ascii_range ? DATA_ASCII : DATA_COUNT;
 
-	_fd = open(_cl_port, O_RDWR | O_NONBLOCK);
+	if (_cl_rx_dump)
+		dump = _cl_rx_dump_ascii ? RX_DUMP_ASCII : RX_DUMP_HEX;
 
-	if (_fd < 0) {
+	if (_payload)
+		source = DATA_PAYLOAD;
+
+	init_pattern_tables();
+	_rx_kernel = rx_kernels[dump][source][!!_cl_dump_err][!!_cl_stop_on_error];
+	_tx_kernel = tx_kernels[!!_cl_write_after_read][source];
+}
+
+static void map_payload(void)
+{
+	struct stat st;
+	int fd, ret;
+
+	fd = open(_cl_payload, O_RDONLY);
+	if (fd < 0) {
 		ret = -errno;
-		perror("Error opening serial port");
+		perror("Error opening payload file");
 		exit(ret);
 	}
 
-	/* Lock device file */
-	if (flock(_fd, LOCK_EX | LOCK_NB) < 0) {
+	if (fstat(fd, &st) < 0) {
 		ret = -errno;
-		perror("Error failed to lock device file");
+		perror("Error reading payload file size");
 		exit(ret);
 	}
 
-	bzero(&newtio, sizeof(newtio)); /* clear struct for new port settings */
-
-	/* man termios get more info on below settings */
-	newtio.c_cflag = CS8 | CLOCAL | CREAD | HUPCL;
-	cfsetispeed(&newtio, baud);
-	cfsetospeed(&newtio, baud);
-
-	if (_cl_rts_cts) {
-		newtio.c_cflag |= CRTSCTS;
+	if (st.st_size == 0) {
+		fprintf(stderr, "ERROR: payload file is empty\n");
+		exit(-EINVAL);
 	}
 
-	if (_cl_2_stop_bit) {
-		newtio.c_cflag |= CSTOPB;
+	if (_cl_payload_offset < 0 || _cl_payload_offset >= st.st_size) {
+		fprintf(stderr, "ERROR: payload offset %lld is outside the %lld byte payload\n",
+				_cl_payload_offset, (long long)st.st_size);
+		exit(-EINVAL);
 	}
 
-	if (_cl_parity) {
-		newtio.c_cflag |= PARENB;
-		if (_cl_odd_parity) {
-			newtio.c_cflag |= PARODD;
-		}
-		if (_cl_stick_parity) {
-			newtio.c_cflag |= CMSPAR;
-		}
+	_payload = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (_payload == MAP_FAILED) {
+		ret = -errno;
+		_payload = NULL;
+		perror("Error mapping payload file");
+		exit(ret);
 	}
+	close(fd);
 
-	newtio.c_iflag = 0;
+	madvise((void *)_payload, st.st_size, MADV_SEQUENTIAL);
+	_payload_size = st.st_size;
+	_payload_tx_off = _payload_rx_off = _cl_payload_offset;
+}
+
+/*
+ * With PARMRK the tty layer escapes line errors in the data stream: a byte
+ * received with a parity or framing error arrives as 0xff 0x00 <byte>, a
+ * break as 0xff 0x00 0x00 and a real 0xff data byte as 0xff 0xff. The
+ * parser below strips the escapes in place, so the verifier sees the plain
+ * data, and reports each error at its offset in that data. Sequences split
+ * across reads are handled by keeping the parser state between calls.
+ */
+enum {
+	PARMRK_DATA,
+	PARMRK_ESC,		/* seen 0xff */
+	PARMRK_ESC_NUL,		/* seen 0xff 0x00 */
+};
+
+static int _parmrk_state = PARMRK_DATA;
+static struct serial_icounter_struct _parmrk_icount;
+static int _parmrk_icount_ok = 1;
+
+static void parmrk_init(void)
+{
+	if (_cl_no_icount || ioctl(_fd, TIOCGICOUNT, &_parmrk_icount) < 0)
+		_parmrk_icount_ok = 0;
+}
+
+/*
+ * The escape does not tell parity and framing errors apart, and a NUL with
+ * a parity or framing error is marked just like a break (0xff 0x00 0x00).
+ * The driver counters tell them apart: each marked error takes one count
+ * from the counter that moved since the errors before it. If the counters
+ * are not available or none moved, a marked NUL is taken as a break.
+ */
+static const char *parmrk_error_kind(unsigned char byte)
+{
+	struct serial_icounter_struct icount;
+	const char *kind = byte ? "parity/frame" : "break";
+
+	if (!_parmrk_icount_ok || ioctl(_fd, TIOCGICOUNT, &icount) < 0)
+		return kind;
+
+	if (byte == 0x00 && icount.brk != _parmrk_icount.brk) {
+		_parmrk_icount.brk++;
+		return "break";
+	}
+
+	if (icount.frame != _parmrk_icount.frame && icount.parity == _parmrk_icount.parity) {
+		_parmrk_icount.frame++;
+		kind = "frame";
+	} else if (icount.parity != _parmrk_icount.parity && icount.frame == _parmrk_icount.frame) {
+		_parmrk_icount.parity++;
+		kind = "parity";
+	} else if (icount.parity != _parmrk_icount.parity) {
+		// both moved, which one this was is not known
+		_parmrk_icount.parity = icount.parity;
+		_parmrk_icount.frame = icount.frame;
+		kind = "parity/frame";
+	}
+
+	return kind;
+}
+
+static void parmrk_report(long long int offset, int is_break, unsigned char byte, const char *kind,
+		const struct timespec *ts)
+{
+	if (is_break)
+		_break_count++;
+	else
+		_line_error_count++;
+
+	if (_cl_dump_err) {
+		struct timespec d;
+
+		d.tv_sec = ts->tv_sec - _start_time.tv_sec;
+		d.tv_nsec = ts->tv_nsec - _start_time.tv_nsec;
+		if (d.tv_nsec < 0) {
+			d.tv_sec--;
+			d.tv_nsec += 1000000000;
+		}
+
+		if (is_break)
+			printf("Break, count: %lld, at %ld.%06lds\n", offset, (long)d.tv_sec, d.tv_nsec / 1000);
+		else
+			printf("Line error (%s), count: %lld, got %02x, at %ld.%06lds\n",
+					kind ? kind : parmrk_error_kind(byte), offset, byte, (long)d.tv_sec, d.tv_nsec / 1000);
+	}
+
+	if (_cl_stop_on_error) {
+		dump_serial_port_stats();
+		exit(-EIO);
+	}
+}
+
+// strip PARMRK escapes from b in place, returns the number of data bytes
+static int parmrk_parse(unsigned char *b, int c)
+{
+	unsigned char *out = b, *p = b, *end = b + c;
+	struct timespec ts = { 0 };
+
+	while (p < end) {
+		if (_parmrk_state == PARMRK_DATA) {
+			// memchr is vectorized in libc, this is the line rate path
+			unsigned char *esc = memchr(p, 0xff, end - p);
+			size_t n = (esc ? esc : end) - p;
+
+			if (out != p)
+				memmove(out, p, n);
+			out += n;
+			p += n;
+			if (!esc)
+				break;
+			p++;
+			_parmrk_state = PARMRK_ESC;
+		} else if (_parmrk_state == PARMRK_ESC) {
+			unsigned char x = *p++;
+
+			if (x == 0x00) {
+				_parmrk_state = PARMRK_ESC_NUL;
+				continue;
+			}
+			/*
+			 * 0xff 0xff is a literal 0xff. The tty layer sends 0xff
+			 * followed by nothing else; if it did, only the byte
+			 * after the 0xff would be kept.
+			 */
+			*out++ = x;
+			_parmrk_state = PARMRK_DATA;
+		} else {
+			unsigned char x = *p++;
+			const char *kind = NULL;
+			int is_break = 0;
+
+			if (ts.tv_sec == 0)
+				clock_gettime(CLOCK_MONOTONIC, &ts);
+			if (x == 0x00) {
+				kind = parmrk_error_kind(x);
+				is_break = !strcmp(kind, "break");
+			}
+			parmrk_report(_read_count + (out - b), is_break, x, kind, &ts);
+			// a break is not a data byte, a byte with a line error is
+			if (!is_break)
+				*out++ = x;
+			_parmrk_state = PARMRK_DATA;
+		}
+	}
+
+	return out - b;
+}
+
+#define READ_BUFFER_SIZE	1024
+
+/* time for one char at current baudrate in us */
+static int char_time_us(void)
+{
+	int baud = _cl_baud ? _cl_baud : 115200;
+
+	return 1000000 * (8 + _cl_parity + 1 + _cl_2_stop_bit) / baud;
+}
+
+/*
+ * RX arrival profile. Every successful read is timestamped, and the number
+ * of bytes it returned and the time since the previous one are kept in
+ * histograms. The chunk sizes show the FIFO trigger level, DMA or USB
+ * transfer sizes; the gaps show FIFO, DMA and latency timeouts.
+ */
+#define RX_PROFILE_GAP_BUCKETS	32	/* log2 of gap in us */
+
+static long long int _rxp_size_hist[READ_BUFFER_SIZE + 1];
+static long long int _rxp_gap_hist[RX_PROFILE_GAP_BUCKETS];
+static long long int _rxp_reads = 0;
+static long long int _rxp_bytes = 0;
+static double _rxp_gap_sum_us = 0;
+static double _rxp_delay_sum = 0;	/* sum over bytes of their position from the end of the read */
+static struct timespec _rxp_last;
+
+static void rx_profile_read(int c)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+
+	_rxp_size_hist[c]++;
+	_rxp_bytes += c;
+	_rxp_delay_sum += (double)c * (c - 1) / 2;
+
+	if (_rxp_reads++) {
+		long long int gap = (now.tv_sec - _rxp_last.tv_sec) * 1000000LL +
+			(now.tv_nsec - _rxp_last.tv_nsec) / 1000;
+		int bucket = 0;
+
+		while (bucket < RX_PROFILE_GAP_BUCKETS - 1 && gap >= (1LL << bucket))
+			bucket++;
+		_rxp_gap_hist[bucket]++;
+		_rxp_gap_sum_us += gap;
+	}
+
+	_rxp_last = now;
+}
+
+// mean buffering delay per byte in us, see rx_profile_dump()
+static double rx_profile_delay_us(void)
+{
+	if (_rxp_bytes == 0)
+		return -1;
+	return _rxp_delay_sum * char_time_us() / _rxp_bytes;
+}
+
+static void rx_profile_dump(void)
+{
+	int chartime = char_time_us();
+	int i, max_size = 0;
+	long long int seen = 0;
+	int p50 = 0, p90 = 0, p99 = 0;
+
+	if (_rxp_reads == 0) {
+		printf("%s: rx profile: no data received\n", _cl_port);
+		return;
+	}
+
+	for (i = 1; i <= READ_BUFFER_SIZE; i++) {
+		if (!_rxp_size_hist[i])
+			continue;
+		max_size = i;
+		seen += _rxp_size_hist[i];
+		if (!p50 && seen * 100 >= _rxp_reads * 50)
+			p50 = i;
+		if (!p90 && seen * 100 >= _rxp_reads * 90)
+			p90 = i;
+		if (!p99 && seen * 100 >= _rxp_reads * 99)
+			p99 = i;
+	}
+
+	printf("%s: rx profile: %lld reads, %lld bytes, %.1f bytes/read, size p50=%d p90=%d p99=%d max=%d\n",
+			_cl_port, _rxp_reads, _rxp_bytes, (double)_rxp_bytes / _rxp_reads, p50, p90, p99, max_size);
+
+	// the most frequent read sizes, largest count first
+	printf("%s: rx profile: read sizes:", _cl_port);
+	for (i = 0; i < 16; i++) {
+		int j, best = 0;
+
+		for (j = 1; j <= READ_BUFFER_SIZE; j++)
+			if (_rxp_size_hist[j] > _rxp_size_hist[best])
+				best = j;
+		if (!best)
+			break;
+		printf(" %d:%.1f%%", best, 100.0 * _rxp_size_hist[best] / _rxp_reads);
+		// hide it for the next round, restored below
+		_rxp_size_hist[best] = -_rxp_size_hist[best];
+	}
+	printf("\n");
+	for (i = 1; i <= READ_BUFFER_SIZE; i++)
+		if (_rxp_size_hist[i] < 0)
+			_rxp_size_hist[i] = -_rxp_size_hist[i];
+
+	if (_rxp_reads > 1) {
+		printf("%s: rx profile: mean gap between reads %.1fus (%.1f chartimes of %dus)\n", _cl_port,
+				_rxp_gap_sum_us / (_rxp_reads - 1), _rxp_gap_sum_us / (_rxp_reads - 1) / chartime,
+				chartime);
+		for (i = 0; i < RX_PROFILE_GAP_BUCKETS; i++) {
+			if (!_rxp_gap_hist[i])
+				continue;
+			printf("%s: rx profile: gap %8lldus - %8lldus: %lld (%.1f%%)\n", _cl_port,
+					i ? 1LL << (i - 1) : 0, (1LL << i) - 1, _rxp_gap_hist[i],
+					100.0 * _rxp_gap_hist[i] / (_rxp_reads - 1));
+		}
+	}
+
+	/*
+	 * Bytes that arrive back to back at line rate and are delivered in one
+	 * read have waited at least one chartime per byte behind them in that
+	 * read. This is the buffering delay added by the FIFO, DMA or USB
+	 * transfer size; it is a lower bound, as the last byte may have waited
+	 * too (e.g. for an RX timeout or USB latency timer).
+	 */
+	printf("%s: rx profile: buffering delay per byte >= %.1fus mean (%.1f chartimes), >= %dus max\n",
+			_cl_port, rx_profile_delay_us(), _rxp_delay_sum / _rxp_bytes,
+			(max_size - 1) * chartime);
+}
+
+/*
+ * Performance counters of the I/O loop (--perf-counters). All counters are
+ * in one perf group on the main thread, led by the software task clock so
+ * the group still opens where there is no PMU (e.g. in a VM). The group is
+ * read each time the loop moves between receiving, transmitting and the
+ * rest of the loop (poll, timers, bookkeeping), and the difference is
+ * charged to the section that just ended. Kernel work done in syscalls is
+ * included; work in interrupt handlers and kworkers is not.
+ */
+enum {
+	PERF_OTHER,
+	PERF_RX,
+	PERF_TX,
+	PERF_SECTIONS,
+};
+
+enum {
+	PERF_TASK_CLOCK,
+	PERF_CONTEXT_SWITCHES,
+	PERF_CYCLES,
+	PERF_CYCLES_KERNEL,
+	PERF_INSTRUCTIONS,
+	PERF_CACHE_MISSES,
+	PERF_EVENTS,
+};
+
+static const struct {
+	const char *name;
+	uint32_t type;
+	uint64_t config;
+	int kernel_only;
+} _perf_events[PERF_EVENTS] = {
+	[PERF_TASK_CLOCK] = { "task-clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, 0 },
+	[PERF_CONTEXT_SWITCHES] = { "context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, 0 },
+	[PERF_CYCLES] = { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, 0 },
+	[PERF_CYCLES_KERNEL] = { "cycles:k", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, 1 },
+	[PERF_INSTRUCTIONS] = { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, 0 },
+	[PERF_CACHE_MISSES] = { "cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, 0 },
+};
+
+// layout of a PERF_FORMAT_GROUP read with the enabled and running times
+struct perf_read {
+	uint64_t nr;
+	uint64_t time_enabled;
+	uint64_t time_running;
+	uint64_t values[PERF_EVENTS];
+};
+
+static int _perf_fd = -1;
+static int _perf_index[PERF_EVENTS];	/* position in the group read, -1 if not counted */
+static int _perf_section = PERF_OTHER;
+static struct perf_read _perf_last;
+static double _perf_counts[PERF_SECTIONS][PERF_EVENTS];
+static struct rusage _perf_rusage;
+
+static int perf_open(const struct perf_event_attr *attr, int group_fd)
+{
+	return syscall(SYS_perf_event_open, attr, 0, -1, group_fd, PERF_FLAG_FD_CLOEXEC);
+}
+
+static void perf_start(void)
+{
+	int i, n = 0, ret;
+
+	for (i = 0; i < PERF_EVENTS; i++) {
+		struct perf_event_attr attr;
+		int fd;
+
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = _perf_events[i].type;
+		attr.config = _perf_events[i].config;
+		attr.exclude_user = _perf_events[i].kernel_only;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+			PERF_FORMAT_TOTAL_TIME_RUNNING;
+		attr.disabled = (_perf_fd < 0);
+
+		_perf_index[i] = -1;
+		fd = perf_open(&attr, _perf_fd);
+		if (fd < 0) {
+			if (_perf_fd < 0) {
+				ret = -errno;
+				perror("perf_event_open");
+				exit(ret);
+			}
+			printf("%s: perf counters: %s not available: %s\n", _cl_port,
+					_perf_events[i].name, strerror(errno));
+			continue;
+		}
+		if (_perf_fd < 0)
+			_perf_fd = fd;
+		_perf_index[i] = n++;
+	}
+
+	getrusage(RUSAGE_SELF, &_perf_rusage);
+	ioctl(_perf_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	if (read(_perf_fd, &_perf_last, sizeof(_perf_last)) < 0) {
+		ret = -errno;
+		perror("perf counters: read");
+		exit(ret);
+	}
+}
+
+// charge the counts since the last call to the current section, then switch
+static void perf_switch(int section)
+{
+	struct perf_read now;
+	double scale;
+	int i;
+
+	if (_perf_fd < 0 || read(_perf_fd, &now, sizeof(now)) < 0)
+		return;
+
+	// scale up if the PMU was shared with other events for part of the time
+	scale = now.time_running > _perf_last.time_running ?
+		(double)(now.time_enabled - _perf_last.time_enabled) /
+		(now.time_running - _perf_last.time_running) : 1;
+
+	for (i = 0; i < PERF_EVENTS; i++) {
+		int idx = _perf_index[i];
+
+		if (idx >= 0)
+			_perf_counts[_perf_section][i] += (now.values[idx] - _perf_last.values[idx]) * scale;
+	}
+
+	_perf_last = now;
+	_perf_section = section;
+}
+
+static void perf_print_row(const char *name, const double *c, long long int bytes)
+{
+	double mb = bytes / 1e6;
+
+	printf("%s: perf %-6s %10.3f", _cl_port, name, bytes / 1e6);
+	if (bytes == 0) {
+		printf("\n");
+		return;
+	}
+
+	printf(" %10.3f %8.1f", c[PERF_TASK_CLOCK] / 1e6 / mb, c[PERF_CONTEXT_SWITCHES] / mb);
+	if (_perf_index[PERF_CYCLES] >= 0)
+		printf(" %12.0f", c[PERF_CYCLES] / mb);
+	else
+		printf(" %12s", "-");
+	if (_perf_index[PERF_INSTRUCTIONS] >= 0)
+		printf(" %12.0f", c[PERF_INSTRUCTIONS] / mb);
+	else
+		printf(" %12s", "-");
+	if (_perf_index[PERF_CYCLES] >= 0 && _perf_index[PERF_INSTRUCTIONS] >= 0 && c[PERF_CYCLES] > 0)
+		printf(" %5.2f", c[PERF_INSTRUCTIONS] / c[PERF_CYCLES]);
+	else
+		printf(" %5s", "-");
+	if (_perf_index[PERF_CACHE_MISSES] >= 0)
+		printf(" %12.0f", c[PERF_CACHE_MISSES] / mb);
+	else
+		printf(" %12s", "-");
+	if (_perf_index[PERF_CYCLES] >= 0 && _perf_index[PERF_CYCLES_KERNEL] >= 0 && c[PERF_CYCLES] > 0)
+		printf(" %8.1f", 100 * c[PERF_CYCLES_KERNEL] / c[PERF_CYCLES]);
+	else
+		printf(" %8s", "-");
+	printf("\n");
+}
+
+static void perf_stop(void)
+{
+	double total[PERF_EVENTS] = { 0 };
+	struct rusage ru;
+	int i, j;
+
+	if (_perf_fd < 0)
+		return;
+
+	perf_switch(PERF_OTHER);
+	ioctl(_perf_fd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+	getrusage(RUSAGE_SELF, &ru);
+
+	for (i = 0; i < PERF_SECTIONS; i++)
+		for (j = 0; j < PERF_EVENTS; j++)
+			total[j] += _perf_counts[i][j];
+
+	printf("%s: perf per MB    %10s %10s %8s %12s %12s %5s %12s %8s\n", _cl_port, "MB", "cpu ms",
+			"ctx-sw", "cycles", "instructions", "IPC", "cache-miss", "kernel %");
+	perf_print_row("rx", _perf_counts[PERF_RX], _read_count);
+	perf_print_row("tx", _perf_counts[PERF_TX], _write_count);
+	// the rest of the loop serves both directions
+	perf_print_row("other", _perf_counts[PERF_OTHER], _read_count + _write_count);
+	perf_print_row("total", total, _read_count + _write_count);
+
+	// whole process, including the reporter thread if there is one
+	printf("%s: perf process cpu time user %.3fs, system %.3fs\n", _cl_port,
+			(ru.ru_utime.tv_sec - _perf_rusage.ru_utime.tv_sec) +
+			(ru.ru_utime.tv_usec - _perf_rusage.ru_utime.tv_usec) / 1e6,
+			(ru.ru_stime.tv_sec - _perf_rusage.ru_stime.tv_sec) +
+			(ru.ru_stime.tv_usec - _perf_rusage.ru_stime.tv_usec) / 1e6);
+
+	close(_perf_fd);
+	_perf_fd = -1;
+}
+
+static void process_read_data(void)
+{
+	unsigned char rb[READ_BUFFER_SIZE];
+	int loopcounter = 0;
+	int actual_read_count = 0;
+	int expected_read_count = _cl_tx_bytes == 0 ? 1024 : _cl_tx_bytes;
+	int chartime = char_time_us();
+
+	while (actual_read_count < expected_read_count) {
+		int c = read(_fd, &rb, sizeof(rb));
+		if (c > 0) {
+			if (_cl_rx_profile)
+				rx_profile_read(c);
+			actual_read_count += c;
+			if (_cl_mark_errors) {
+				c = parmrk_parse(rb, c);
+				if (c == 0)
+					continue;
+			}
+			_rx_kernel(rb, c);
+			_read_count += c;
+			if (_cl_count && _read_count >= _cl_count)
+				break;
+		} else if (errno) {
+			if (errno != EAGAIN) {
+				perror("read failed");
+			}
+
+			if (loopcounter++ < expected_read_count) {
+				usleep(chartime);
+				continue; // Retry the read
+			}
+			break;
+		} else {
+		    break;
+		}
+	}
+	if (_cl_rx_detailed) {
+		printf("Read %d bytes\n", actual_read_count);
+	}
+}
+
+static void setup_serial_port(int baud)
+{
+	struct termios newtio;
+	struct serial_rs485 rs485;
+	int ret;
+
+	open_step_begin();
+	_fd = open(_cl_port, O_RDWR | O_NONBLOCK);
+	open_step_done(STEP_OPEN);
+
+	if (_fd < 0) {
+		ret = -errno;
+		perror("Error opening serial port");
+		exit(ret);
+	}
+
+	/* Lock device file */
+	ret = flock(_fd, LOCK_EX | LOCK_NB);
+	open_step_done(STEP_FLOCK);
+	if (ret < 0) {
+		ret = -errno;
+		perror("Error failed to lock device file");
+		exit(ret);
+	}
+
+	bzero(&newtio, sizeof(newtio)); /* clear struct for new port settings */
+
+	/* man termios get more info on below settings */
+	newtio.c_cflag = CS8 | CLOCAL | CREAD | HUPCL;
+	cfsetispeed(&newtio, baud);
+	cfsetospeed(&newtio, baud);
+
+	if (_cl_rts_cts) {
+		newtio.c_cflag |= CRTSCTS;
+	}
+
+	if (_cl_2_stop_bit) {
+		newtio.c_cflag |= CSTOPB;
+	}
+
+	if (_cl_parity) {
+		newtio.c_cflag |= PARENB;
+		if (_cl_odd_parity) {
+			newtio.c_cflag |= PARODD;
+		}
+		if (_cl_stick_parity) {
+			newtio.c_cflag |= CMSPAR;
+		}
+	}
+
+	newtio.c_iflag = 0;
+	if (_cl_mark_errors) {
+		newtio.c_iflag |= INPCK | PARMRK;
+	}
+	if (_cl_ignore_break) {
+		newtio.c_iflag |= IGNBRK;
+	}
 	newtio.c_oflag = 0;
 	newtio.c_lflag = 0;
 
-	// block for up till 128 characters
-	newtio.c_cc[VMIN] = 128;
+	// block for up till 128 characters
+	newtio.c_cc[VMIN] = 128;
+
+	// 0.5 seconds read timeout
+	newtio.c_cc[VTIME] = 5;
+
+	/* now clean the modem line and activate the settings for the port */
+	open_step_begin();
+	tcflush(_fd, TCIOFLUSH);
+	open_step_done(STEP_TCFLUSH);
+	tcsetattr(_fd,TCSANOW,&newtio);
+	open_step_done(STEP_TCSETATTR);
+
+	/* enable/disable rs485 direction control, first check if RS485 is supported */
+	ret = ioctl(_fd, TIOCGRS485, &rs485);
+	open_step_done(STEP_GET_RS485);
+	if (ret < 0) {
+		if (_cl_rs485) {
+			/* error could be because hardware is missing rs485 support so only print when actually trying to activate it */
+			perror("Error getting RS-485 mode");
+		}
+	} else {
+		if (_cl_rs485) {
+			/* Default to 0 if not specified */
+			if (_cl_rs485_after_delay < 0)
+				_cl_rs485_after_delay = 0;
+
+			/* Skip reconfiguration if already enabled with default delays */
+			if (rs485.flags & SER_RS485_ENABLED) {
+				printf("RS485 already enabled on port with default settings\n");
+			} else {
+				/* enable RS485 */
+				rs485.flags |= SER_RS485_ENABLED | SER_RS485_RX_DURING_TX |
+							   (_cl_rs485_rts_after_send ? SER_RS485_RTS_AFTER_SEND : SER_RS485_RTS_ON_SEND);
+				rs485.flags &= ~(_cl_rs485_rts_after_send ? SER_RS485_RTS_ON_SEND : SER_RS485_RTS_AFTER_SEND);
+				rs485.delay_rts_after_send = _cl_rs485_after_delay;
+				rs485.delay_rts_before_send = _cl_rs485_before_delay;
+				open_step_begin();
+				ret = ioctl(_fd, TIOCSRS485, &rs485);
+				open_step_done(STEP_SET_RS485);
+				if (ret < 0) {
+					perror("Error setting RS-485 mode");
+				}
+			}
+		} else {
+			/* disable RS485 */
+			rs485.flags &= ~(SER_RS485_ENABLED | SER_RS485_RTS_ON_SEND | SER_RS485_RTS_AFTER_SEND);
+			rs485.delay_rts_after_send = 0;
+			rs485.delay_rts_before_send = 0;
+			open_step_begin();
+			ret = ioctl(_fd, TIOCSRS485, &rs485);
+			open_step_done(STEP_SET_RS485);
+			if (ret < 0) {
+				perror("Error setting RS-232 mode");
+			}
+		}
+	}
+}
+
+static int diff_ms(const struct timespec *t1, const struct timespec *t2)
+{
+	struct timespec diff;
+
+	diff.tv_sec = t1->tv_sec - t2->tv_sec;
+	diff.tv_nsec = t1->tv_nsec - t2->tv_nsec;
+	if (diff.tv_nsec < 0) {
+		diff.tv_sec--;
+		diff.tv_nsec += 1000000000;
+	}
+	return (diff.tv_sec * 1000 + diff.tv_nsec/1000000);
+}
+
+static double diff_s(const struct timespec *t1, const struct timespec *t2)
+{
+	return (t1->tv_sec - t2->tv_sec) + (t1->tv_nsec - t2->tv_nsec) / 1e9;
+}
+
+/*
+ * Run control timers. A timerfd armed for an absolute time is part of the
+ * poll set, so the loop wakes up when the timer expires instead of noticing
+ * it on the next pass.
+ */
+static int start_timer(const struct timespec *start, long long int ms)
+{
+	struct itimerspec its;
+	int fd, ret;
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0) {
+		ret = -errno;
+		perror("timerfd_create");
+		exit(ret);
+	}
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = start->tv_sec + ms / 1000;
+	its.it_value.tv_nsec = start->tv_nsec + (ms % 1000) * 1000000;
+	if (its.it_value.tv_nsec >= 1000000000) {
+		its.it_value.tv_sec++;
+		its.it_value.tv_nsec -= 1000000000;
+	}
+
+	if (timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+		ret = -errno;
+		perror("timerfd_settime");
+		exit(ret);
+	}
+
+	return fd;
+}
+
+// returns 1 once if the timer in pfd expired, and closes it
+static int timer_expired(struct pollfd *pfd)
+{
+	if (pfd->fd < 0 || !(pfd->revents & POLLIN))
+		return 0;
+
+	close(pfd->fd);
+	pfd->fd = -1;
+	return 1;
+}
+
+// first and last transfer in one direction, for the rates at the end
+struct run_rate {
+	long long int bytes;
+	long long int first_bytes;
+	struct timespec first;
+	struct timespec last;
+};
+
+static void run_rate_update(struct run_rate *r, long long int count, const struct timespec *now)
+{
+	if (count == r->bytes)
+		return;
+
+	if (r->bytes == 0) {
+		r->first = *now;
+		r->first_bytes = count;
+	}
+	r->last = *now;
+	r->bytes = count;
+}
+
+/*
+ * Bytes per second, or -1 if there were not at least two transfers. The
+ * first transfer marks the start of the interval, so its bytes are not
+ * part of the rate.
+ */
+static double run_rate_value(const struct run_rate *r)
+{
+	double s = diff_s(&r->last, &r->first);
+
+	if (r->bytes == 0 || s <= 0)
+		return -1;
+	return (r->bytes - r->first_bytes) / s;
+}
+
+static void run_rate_print(const char *dir, const struct run_rate *r)
+{
+	double line_rate = (double)(_cl_baud ? _cl_baud : 115200) / (10 + _cl_parity + _cl_2_stop_bit);
+	double s = diff_s(&r->last, &r->first);
+	double rate = run_rate_value(r);
+
+	if (r->bytes == 0) {
+		printf("%s: %s: no data\n", _cl_port, dir);
+		return;
+	}
+
+	if (rate >= 0) {
+		printf("%s: %s %lld bytes, %.6fs from first to last, %.1f bytes/s (%.1f%% of line rate)\n",
+				_cl_port, dir, r->bytes, s, rate, 100.0 * rate / line_rate);
+	} else {
+		printf("%s: %s %lld bytes in a single transfer\n", _cl_port, dir, r->bytes);
+	}
+}
+
+/*
+ * Driver error counters, for the features that report them per interval.
+ * Each one keeps its own ok flag, cleared when TIOCGICOUNT fails so it is
+ * not tried again; the counters then read as zero.
+ */
+static void get_icount(struct serial_icounter_struct *icount, int *ok)
+{
+	memset(icount, 0, sizeof(*icount));
+	if (_cl_no_icount || !*ok)
+		return;
+
+	if (ioctl(_fd, TIOCGICOUNT, icount) < 0) {
+		perror("Error getting TIOCGICOUNT");
+		memset(icount, 0, sizeof(*icount));
+		*ok = 0;
+	}
+}
+
+/*
+ * Rolling history of per-interval deltas. All rings are statically
+ * allocated, so memory use does not grow with the length of the run.
+ * Each 1s sample is pushed into the finest ring and accumulated into
+ * the next coarser one, which is pushed once it covers its interval.
+ */
+struct history_sample {
+	long long int t;	/* seconds since start of interval */
+	long long int rx;
+	long long int tx;
+	long long int err;
+	int frame;
+	int overrun;
+	int parity;
+	int brk;
+	int buf_overrun;
+	int partial_ms;		/* length if the interval was cut short at exit, else 0 */
+};
+
+struct history_ring {
+	const char *name;
+	int interval_s;
+	int size;
+	struct history_sample *slots;
+	int head;
+	int used;
+	struct history_sample acc;
+	int acc_n;
+};
+
+#define HISTORY_1S_SLOTS	300	/* 5 minutes */
+#define HISTORY_1M_SLOTS	1440	/* 1 day */
+#define HISTORY_1H_SLOTS	720	/* 30 days */
+
+static struct history_sample _history_1s[HISTORY_1S_SLOTS];
+static struct history_sample _history_1m[HISTORY_1M_SLOTS];
+static struct history_sample _history_1h[HISTORY_1H_SLOTS];
+
+static struct history_ring _history[] = {
+	{ "1s", 1, HISTORY_1S_SLOTS, _history_1s },
+	{ "1min", 60, HISTORY_1M_SLOTS, _history_1m },
+	{ "1h", 3600, HISTORY_1H_SLOTS, _history_1h },
+};
+
+#define HISTORY_RINGS	(sizeof(_history) / sizeof(_history[0]))
+
+static int _history_started = 0;
+static int _history_icount_ok = 1;
+static long long int _history_elapsed = 0;
+static int _history_partial_ms = 0;	/* of the last second, once flushed */
+static time_t _history_start_wall;
+static struct timespec _history_last;
+static struct history_sample _history_prev;	/* totals at last sample */
+
+static void history_get_totals(struct history_sample *s)
+{
+	struct serial_icounter_struct icount;
+
+	s->rx = _read_count;
+	s->tx = _write_count;
+	s->err = _error_count;
+
+	get_icount(&icount, &_history_icount_ok);
+
+	s->frame = icount.frame;
+	s->overrun = icount.overrun;
+	s->parity = icount.parity;
+	s->brk = icount.brk;
+	s->buf_overrun = icount.buf_overrun;
+}
+
+static void history_add(struct history_sample *acc, const struct history_sample *s)
+{
+	acc->rx += s->rx;
+	acc->tx += s->tx;
+	acc->err += s->err;
+	acc->frame += s->frame;
+	acc->overrun += s->overrun;
+	acc->parity += s->parity;
+	acc->brk += s->brk;
+	acc->buf_overrun += s->buf_overrun;
+}
+
+static void history_delta(struct history_sample *d, const struct history_sample *cur,
+		const struct history_sample *prev)
+{
+	d->rx = cur->rx - prev->rx;
+	d->tx = cur->tx - prev->tx;
+	d->err = cur->err - prev->err;
+	d->frame = cur->frame - prev->frame;
+	d->overrun = cur->overrun - prev->overrun;
+	d->parity = cur->parity - prev->parity;
+	d->brk = cur->brk - prev->brk;
+	d->buf_overrun = cur->buf_overrun - prev->buf_overrun;
+	d->partial_ms = 0;
+}
+
+static void history_ring_put(struct history_ring *r, const struct history_sample *s)
+{
+	r->slots[r->head] = *s;
+	r->head = (r->head + 1) % r->size;
+	if (r->used < r->size)
+		r->used++;
+}
+
+static void history_push(unsigned int level, const struct history_sample *s)
+{
+	struct history_ring *r = &_history[level];
+
+	history_ring_put(r, s);
+
+	if (level + 1 >= HISTORY_RINGS)
+		return;
+
+	struct history_ring *up = &_history[level + 1];
+
+	if (up->acc_n == 0)
+		up->acc.t = s->t;
+	history_add(&up->acc, s);
+	if (++up->acc_n * r->interval_s >= up->interval_s) {
+		history_push(level + 1, &up->acc);
+		memset(&up->acc, 0, sizeof(up->acc));
+		up->acc_n = 0;
+	}
+}
+
+static void history_start(const struct timespec *now)
+{
+	_history_last = *now;
+	_history_start_wall = time(NULL);
+	history_get_totals(&_history_prev);
+	_history_started = 1;
+}
+
+static void history_update(const struct timespec *now)
+{
+	int elapsed = diff_ms(now, &_history_last);
+
+	if (elapsed < 1000 || _history_started != 1)
+		return;
+
+	struct history_sample cur, delta;
+
+	history_get_totals(&cur);
+	history_delta(&delta, &cur, &_history_prev);
+	delta.t = _history_elapsed;
+	_history_prev = cur;
+
+	/*
+	 * If the loop was stalled for more than a second, the deltas are
+	 * attributed to the first interval and the rest are recorded empty,
+	 * so the coarser rings stay aligned with the start of the run.
+	 */
+	history_push(0, &delta);
+	_history_elapsed++;
+	_history_last.tv_sec++;
+	elapsed -= 1000;
+
+	while (elapsed >= 1000) {
+		memset(&delta, 0, sizeof(delta));
+		delta.t = _history_elapsed;
+		history_push(0, &delta);
+		_history_elapsed++;
+		_history_last.tv_sec++;
+		elapsed -= 1000;
+	}
+}
+
+/*
+ * At exit, record the last, partial second in the 1s ring and add it to
+ * the 1min accumulator, without completing any coarser interval. The dump
+ * then shows the partial accumulators too, so the end of the run (e.g.
+ * the error that stopped it with -S) is not lost.
+ */
+static void history_flush(void)
+{
+	struct history_sample cur, delta;
+	struct history_ring *up = &_history[1];
+	struct timespec now;
+
+	if (!_history_started)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	history_update(&now);
+
+	history_get_totals(&cur);
+	history_delta(&delta, &cur, &_history_prev);
+	delta.t = _history_elapsed;
+	delta.partial_ms = diff_ms(&now, &_history_last);
+	_history_prev = cur;
+	if (delta.partial_ms <= 0)
+		return;
+
+	history_ring_put(&_history[0], &delta);
+	if (up->acc_n == 0)
+		up->acc.t = delta.t;
+	history_add(&up->acc, &delta);
+	up->acc.partial_ms = 1;
+	_history_partial_ms = delta.partial_ms;
+	_history_started = 2;	/* flushed, no more updates */
+}
+
+static void history_print(const char *name, const struct history_sample *s, long long int len_ms)
+{
+	char partial[48] = "";
+
+	if (len_ms)
+		snprintf(partial, sizeof(partial), " partial, %.1fs", len_ms / 1000.0);
+	printf("%s: [%s +%llds%s] rx=%lld, tx=%lld, rx err=%lld, frame = %i, overrun = %i, parity = %i, brk = %i, buf_overrun = %i\n",
+			_cl_port, name, s->t, partial, s->rx, s->tx, s->err, s->frame, s->overrun, s->parity,
+			s->brk, s->buf_overrun);
+}
+
+static void history_dump(void)
+{
+	char started[64];
+	unsigned int level;
+	double elapsed = _history_elapsed;
+	struct history_sample partial;
+	int have_partial = 0;
+
+	if (!_history_started)
+		return;
+
+	elapsed += _history_partial_ms / 1000.0;
+
+	strftime(started, sizeof(started), "%Y-%m-%d %H:%M:%S", localtime(&_history_start_wall));
+	printf("%s: history, started %s, %.1fs elapsed\n", _cl_port, started, elapsed);
+
+	memset(&partial, 0, sizeof(partial));
+	for (level = 0; level < HISTORY_RINGS; level++) {
+		struct history_ring *r = &_history[level];
+		int i;
+
+		printf("%s: history at %s resolution (%d of %d intervals)\n", _cl_port, r->name, r->used,
+				r->size);
+
+		for (i = 0; i < r->used; i++) {
+			const struct history_sample *s = &r->slots[(r->head - r->used + i + r->size) % r->size];
+
+			history_print(r->name, s, s->partial_ms);
+		}
+
+		/*
+		 * The interval in progress holds the finished finer intervals
+		 * not yet pushed, plus the one in progress at the finer level.
+		 */
+		if (level == 0)
+			continue;
+		if (r->acc_n || r->acc.partial_ms) {
+			// a coarser interval started earlier
+			partial.t = r->acc.t;
+			history_add(&partial, &r->acc);
+			have_partial = 1;
+		}
+		if (have_partial)
+			history_print(r->name, &partial, (long long int)((elapsed - partial.t) * 1000));
+	}
+	fflush(stdout);
+}
+
+/*
+ * Background load (--load). Worker threads compete with the test for the
+ * CPU (spinning), for memory bandwidth (large memcpy()s) and for the caches
+ * (random writes all over a buffer several times the last level cache).
+ * With --load-step the load is a ramp: level 0 is idle, and at level k the
+ * first k workers of each kind run. Throughput, errors, the TIOCGICOUNT
+ * overrun counters and the largest time between reads are kept per level.
+ */
+#define LOAD_MEM_MIN_SIZE	(16 * 1024 * 1024)
+#define LOAD_MEM_CHUNK	(1024 * 1024)
+#define LOAD_CACHE_LINE	64
+
+enum {
+	LOAD_CPU,
+	LOAD_MEM,
+	LOAD_CACHE,
+	LOAD_KINDS,
+};
+
+static const char *_load_names[LOAD_KINDS] = { "cpu", "mem", "cache" };
+
+struct load_worker {
+	pthread_t thread;
+	int kind;
+	int index;		/* runs from level index + 1 */
+	long long int bytes;	/* memory copied or touched */
+};
+
+struct load_totals {
+	long long int rx;
+	long long int tx;
+	long long int err;
+	int overrun;
+	int buf_overrun;
+};
+
+struct load_level {
+	double s;
+	struct load_totals delta;
+	long long int mem_bytes;
+	long long int reads;
+	double gap_sum_ms;
+	double gap_max_ms;
+	long long int lat_n;
+	double lat_sum_ms;
+	double lat_max_ms;
+};
+
+/*
+ * Write-to-read latency: each write is stamped with the write count it
+ * ends at, and is delivered once the read count gets there. Only
+ * meaningful with a loopback, and lost bytes make it read high.
+ */
+#define LOAD_WRITE_SLOTS	1024
+
+struct load_write {
+	long long int count;
+	struct timespec t;
+};
+
+static int _load_count[LOAD_KINDS];
+static int _load_max;
+static struct load_worker *_load_workers;
+static int _load_nworkers;
+static volatile int _load_level;
+static volatile int _load_stop;
+static size_t _load_mem_size;
+static struct load_level *_load_levels;
+static int _load_nlevels;
+static struct timespec _load_level_start;
+static struct timespec _load_last_read;
+static long long int _load_last_count;
+static struct load_totals _load_totals;
+static int _load_icount_ok = 1;
+static long long int _load_mem_total;
+static struct load_write _load_writes[LOAD_WRITE_SLOTS];
+static int _load_write_head, _load_write_tail;
+static long long int _load_write_count;
+
+static void *load_worker_thread(void *arg)
+{
+	struct load_worker *w = arg;
+	unsigned char *a = NULL, *b = NULL;
+	volatile uint64_t sink = 0;
+	uint64_t x = 0x9e3779b97f4a7c15ULL + w->index;
+	size_t off = 0;
+
+	if (w->kind != LOAD_CPU) {
+		a = malloc(_load_mem_size);
+		b = w->kind == LOAD_MEM ? malloc(_load_mem_size) : NULL;
+		if (!a || (w->kind == LOAD_MEM && !b)) {
+			fprintf(stderr, "ERROR: Memory allocation failed\n");
+			exit(-ENOMEM);
+		}
+		memset(a, 1, _load_mem_size);
+		if (b)
+			memset(b, 2, _load_mem_size);
+	}
+
+	while (!_load_stop) {
+		size_t i;
+
+		if (w->index >= _load_level) {
+			usleep(10000);
+			continue;
+		}
+
+		switch (w->kind) {
+		case LOAD_CPU:
+			for (i = 0; i < 1000000; i++)
+				x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+			sink = x;
+			break;
+		case LOAD_MEM:
+			memcpy(b + off, a + off, LOAD_MEM_CHUNK);
+			off = (off + LOAD_MEM_CHUNK) % _load_mem_size;
+			__atomic_add_fetch(&w->bytes, LOAD_MEM_CHUNK, __ATOMIC_RELAXED);
+			break;
+		case LOAD_CACHE:
+			// one write per line at random, so every access misses
+			for (i = 0; i < 100000; i++) {
+				x ^= x >> 12;
+				x ^= x << 25;
+				x ^= x >> 27;
+				a[(x % (_load_mem_size / LOAD_CACHE_LINE)) * LOAD_CACHE_LINE]++;
+			}
+			__atomic_add_fetch(&w->bytes, 100000 * LOAD_CACHE_LINE, __ATOMIC_RELAXED);
+			break;
+		}
+	}
+
+	(void)sink;
+	free(a);
+	free(b);
+	return NULL;
+}
+
+static void load_parse(void)
+{
+	char *copy = strdup(_cl_load), *save = NULL, *tok;
+	int i;
+
+	for (tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		char name[16];
+		int n;
+
+		for (i = 0; i < LOAD_KINDS; i++)
+			if (sscanf(tok, "%15[a-z]=%d", name, &n) == 2 && !strcmp(name, _load_names[i]))
+				break;
+		if (i == LOAD_KINDS || n < 0) {
+			fprintf(stderr, "ERROR: bad load %s, use cpu=N, mem=N or cache=N\n", tok);
+			exit(-EINVAL);
+		}
+		_load_count[i] = n;
+		_load_nworkers += n;
+		if (n > _load_max)
+			_load_max = n;
+	}
+	free(copy);
+}
+
+static void load_get_totals(struct load_totals *t)
+{
+	struct serial_icounter_struct icount;
+
+	t->rx = _read_count;
+	t->tx = _write_count;
+	t->err = _error_count;
+
+	get_icount(&icount, &_load_icount_ok);
+	t->overrun = icount.overrun;
+	t->buf_overrun = icount.buf_overrun;
+}
+
+static void load_start(const struct timespec *start)
+{
+	long cache = sysconf(_SC_LEVEL3_CACHE_SIZE);
+	int cpus[CPU_SETSIZE], ncpus = 0;
+	int kind, i, n = 0;
+
+	load_parse();
+
+	if (_cl_load_cpus) {
+		char *copy = strdup(_cl_load_cpus), *save = NULL, *tok;
+
+		for (tok = strtok_r(copy, ",", &save); tok && ncpus < CPU_SETSIZE; tok = strtok_r(NULL, ",", &save))
+			cpus[ncpus++] = atoi(tok);
+		free(copy);
+	}
+
+	// past the last level cache, so the copies and writes go to memory
+	_load_mem_size = cache > 0 && 2 * (size_t)cache > LOAD_MEM_MIN_SIZE ? 2 * (size_t)cache : LOAD_MEM_MIN_SIZE;
+	_load_mem_size -= _load_mem_size % LOAD_MEM_CHUNK;
+
+	_load_workers = calloc(_load_nworkers ? _load_nworkers : 1, sizeof(*_load_workers));
+	_load_levels = calloc(_load_max + 1, sizeof(*_load_levels));
+	if (!_load_workers || !_load_levels) {
+		fprintf(stderr, "ERROR: Memory allocation failed\n");
+		exit(-ENOMEM);
+	}
+
+	// without a ramp everything runs from the start, as a single level
+	_load_level = _cl_load_step_ms ? 0 : _load_max;
+
+	for (kind = 0; kind < LOAD_KINDS; kind++) {
+		for (i = 0; i < _load_count[kind]; i++, n++) {
+			struct load_worker *w = &_load_workers[n];
+			pthread_attr_t attr;
+			int ret;
+
+			w->kind = kind;
+			w->index = i;
+			pthread_attr_init(&attr);
+			if (ncpus) {
+				cpu_set_t set;
+
+				CPU_ZERO(&set);
+				CPU_SET(cpus[n % ncpus], &set);
+				pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+			}
+			ret = pthread_create(&w->thread, &attr, load_worker_thread, w);
+			pthread_attr_destroy(&attr);
+			if (ret) {
+				fprintf(stderr, "ERROR: cannot start load thread: %s\n", strerror(ret));
+				exit(-ret);
+			}
+		}
+	}
+
+	printf("%s: load %d cpu, %d mem, %d cache threads, %zu MB buffers%s\n", _cl_port,
+			_load_count[LOAD_CPU], _load_count[LOAD_MEM], _load_count[LOAD_CACHE],
+			_load_mem_size >> 20, _cl_load_cpus ? ", pinned" : "");
+
+	_load_level_start = *start;
+	_load_write_count = _write_count;
+	load_get_totals(&_load_totals);
+}
+
+static long long int load_mem_bytes(void)
+{
+	long long int sum = 0;
+	int i;
+
+	for (i = 0; i < _load_nworkers; i++)
+		sum += __atomic_load_n(&_load_workers[i].bytes, __ATOMIC_RELAXED);
+	return sum;
+}
+
+// close the current level's results
+static void load_level_done(const struct timespec *now)
+{
+	struct load_level *l = &_load_levels[_load_nlevels++];
+	struct load_totals totals;
+	long long int mem = load_mem_bytes();
+
+	load_get_totals(&totals);
+	l->s = diff_s(now, &_load_level_start);
+	l->delta.rx = totals.rx - _load_totals.rx;
+	l->delta.tx = totals.tx - _load_totals.tx;
+	l->delta.err = totals.err - _load_totals.err;
+	l->delta.overrun = totals.overrun - _load_totals.overrun;
+	l->delta.buf_overrun = totals.buf_overrun - _load_totals.buf_overrun;
+	l->mem_bytes = mem - _load_mem_total;
+
+	_load_totals = totals;
+	_load_mem_total = mem;
+	_load_level_start = *now;
+	_load_last_read.tv_sec = 0;
+}
+
+// now is from just before the write, if there was one
+static void load_tx(const struct timespec *now)
+{
+	int next = (_load_write_head + 1) % LOAD_WRITE_SLOTS;
+
+	if (_write_count == _load_write_count)
+		return;
+	_load_write_count = _write_count;
+
+	// when full, the write is left out and the next one covers its bytes
+	if (next == _load_write_tail)
+		return;
+	_load_writes[_load_write_head].count = _write_count;
+	_load_writes[_load_write_head].t = *now;
+	_load_write_head = next;
+}
+
+static void load_rx(void)
+{
+	struct load_level *l = &_load_levels[_load_nlevels];
+	struct timespec now;
+
+	if (_read_count == _load_last_count)
+		return;
+	_load_last_count = _read_count;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if (_load_last_read.tv_sec) {
+		double gap = diff_s(&now, &_load_last_read) * 1000;
+
+		l->reads++;
+		l->gap_sum_ms += gap;
+		if (gap > l->gap_max_ms)
+			l->gap_max_ms = gap;
+	}
+	_load_last_read = now;
+
+	while (_load_write_tail != _load_write_head &&
+			_load_writes[_load_write_tail].count <= _read_count) {
+		double lat = diff_s(&now, &_load_writes[_load_write_tail].t) * 1000;
+
+		l->lat_n++;
+		l->lat_sum_ms += lat;
+		if (lat > l->lat_max_ms)
+			l->lat_max_ms = lat;
+		_load_write_tail = (_load_write_tail + 1) % LOAD_WRITE_SLOTS;
+	}
+}
+
+// step the ramp, returns 1 once the last level is done
+static int load_update(const struct timespec *now)
+{
+	if (_load_nlevels > _load_max)
+		return 0;
+	load_tx(now);
+	load_rx();
+	if (!_cl_load_step_ms || diff_ms(now, &_load_level_start) < _cl_load_step_ms)
+		return 0;
+
+	load_level_done(now);
+	if (_load_nlevels > _load_max)
+		return 1;
+
+	_load_level = _load_nlevels;
+	printf("%s: load level %d\n", _cl_port, _load_level);
+	return 0;
+}
+
+static void load_stop(const struct timespec *now)
+{
+	int i;
+
+	if (!_load_levels)
+		return;
+	if (_load_nlevels <= _load_max)
+		load_level_done(now);
+
+	_load_stop = 1;
+	for (i = 0; i < _load_nworkers; i++)
+		pthread_join(_load_workers[i].thread, NULL);
+}
+
+static void load_report(void)
+{
+	int i, k;
+
+	if (!_load_levels)
+		return;
+
+	printf("%s: %5s %-14s %12s %12s %7s %8s %11s %11s %11s %11s %11s %10s\n", _cl_port, "level",
+			"threads", "tx bytes/s", "rx bytes/s", "errors", "overrun", "buf_overrun", "mean gap",
+			"max gap", "mean lat", "max lat", "load MB/s");
+	for (i = 0; i < _load_nlevels; i++) {
+		struct load_level *l = &_load_levels[i];
+		int level = _cl_load_step_ms ? i : _load_max;
+		int active[LOAD_KINDS];
+		char threads[32], rates[64], gaps[32], lats[32], mem[16];
+
+		for (k = 0; k < LOAD_KINDS; k++)
+			active[k] = level < _load_count[k] ? level : _load_count[k];
+		snprintf(threads, sizeof(threads), "%d/%d/%d", active[LOAD_CPU], active[LOAD_MEM],
+				active[LOAD_CACHE]);
+
+		// a level cut short at the very end can have no length
+		if (l->s > 0) {
+			snprintf(rates, sizeof(rates), "%12.1f %12.1f", l->delta.tx / l->s, l->delta.rx / l->s);
+			snprintf(mem, sizeof(mem), "%10.1f", l->mem_bytes / l->s / 1e6);
+		} else {
+			snprintf(rates, sizeof(rates), "%12s %12s", "-", "-");
+			snprintf(mem, sizeof(mem), "%10s", "-");
+		}
+		if (l->reads)
+			snprintf(gaps, sizeof(gaps), "%9.2fms %9.2fms", l->gap_sum_ms / l->reads, l->gap_max_ms);
+		else
+			snprintf(gaps, sizeof(gaps), "%11s %11s", "-", "-");
+		if (l->lat_n)
+			snprintf(lats, sizeof(lats), "%9.2fms %9.2fms", l->lat_sum_ms / l->lat_n, l->lat_max_ms);
+		else
+			snprintf(lats, sizeof(lats), "%11s %11s", "-", "-");
+
+		printf("%s: %5d %-14s %s %7lld %8d %11d %s %s %s\n", _cl_port, level, threads, rates,
+				l->delta.err, l->delta.overrun, l->delta.buf_overrun, gaps, lats, mem);
+	}
+	printf("%s: threads are cpu/mem/cache, gap is the time between reads, lat from write to read%s\n",
+			_cl_port, _cl_no_icount ? ", overruns not counted (-n)" : "");
+
+	free(_load_levels);
+	free(_load_workers);
+	_load_levels = NULL;
+}
+
+/*
+ * Live metrics. The I/O loop publishes its counters into a stats block with
+ * plain stores under a sequence count; a reporter thread owns everything
+ * slow (TIOCGICOUNT, printing, serving the Unix socket) and publishes the
+ * icount fields under a sequence count of its own, so each count has a
+ * single writer. A consistent snapshot is one where neither count was odd
+ * or changed while copying. The block can be placed in POSIX shared memory
+ * so other processes can map it directly.
+ */
+#define METRICS_MAGIC	0x4c535453	/* "LSTS" */
+#define METRICS_VERSION	3
+
+struct metrics_block {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t seq;		/* odd while the I/O loop is updating */
+	uint32_t icount_seq;	/* odd while the reporter thread is updating */
+	uint32_t icount_ok;
+	uint32_t marked;	/* line_errors and breaks are counted (--mark-errors) */
+	char port[64];
+	// written by the I/O loop
+	int64_t rx_bytes;
+	int64_t tx_bytes;
+	int64_t rx_errors;
+	int64_t line_errors;	/* marked parity/frame errors */
+	int64_t breaks;		/* marked breaks */
+	int64_t updated_ms;	/* since start of test */
+	// written by the reporter thread
+	int64_t icount_rx;
+	int64_t icount_tx;
+	int64_t icount_frame;
+	int64_t icount_overrun;
+	int64_t icount_parity;
+	int64_t icount_brk;
+	int64_t icount_buf_overrun;
+};
+
+static struct metrics_block *_metrics = NULL;
+static struct timespec _metrics_start;
+static pthread_t _metrics_thread;
+static int _metrics_thread_running = 0;
+static int _metrics_listen_fd = -1;
+static int _metrics_wake[2] = { -1, -1 };
+
+static void metrics_publish(const struct timespec *now)
+{
+	struct metrics_block *m = _metrics;
+
+	m->seq++;
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	m->rx_bytes = _read_count;
+	m->tx_bytes = _write_count;
+	m->rx_errors = _error_count;
+	m->line_errors = _line_error_count;
+	m->breaks = _break_count;
+	m->updated_ms = diff_ms(now, &_metrics_start);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	m->seq++;
+}
+
+static void metrics_snapshot(struct metrics_block *snap)
+{
+	const volatile struct metrics_block *m = _metrics;
+	uint32_t seq, icount_seq;
+
+	do {
+		while (((seq = m->seq) | (icount_seq = m->icount_seq)) & 1)
+			sched_yield();
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		memcpy(snap, (const void *)m, sizeof(*snap));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (m->seq != seq || m->icount_seq != icount_seq);
+}
+
+static void metrics_update_icount(void)
+{
+	struct serial_icounter_struct icount = { 0 };
+
+	if (_cl_no_icount || !_metrics->icount_ok)
+		return;
+
+	if (ioctl(_fd, TIOCGICOUNT, &icount) < 0) {
+		perror("metrics: Error getting TIOCGICOUNT");
+		_metrics->icount_seq++;
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		_metrics->icount_ok = 0;
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		_metrics->icount_seq++;
+		return;
+	}
+
+	_metrics->icount_seq++;
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	_metrics->icount_rx = icount.rx;
+	_metrics->icount_tx = icount.tx;
+	_metrics->icount_frame = icount.frame;
+	_metrics->icount_overrun = icount.overrun;
+	_metrics->icount_parity = icount.parity;
+	_metrics->icount_brk = icount.brk;
+	_metrics->icount_buf_overrun = icount.buf_overrun;
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	_metrics->icount_seq++;
+}
+
+static int metrics_format(char *buf, size_t len, const struct metrics_block *m)
+{
+	if (_cl_metrics_json) {
+		return snprintf(buf, len,
+				"{\"port\": \"%s\", \"rx_bytes\": %lld, \"tx_bytes\": %lld, \"rx_errors\": %lld, "
+				"\"marked\": {\"valid\": %s, \"line_errors\": %lld, \"breaks\": %lld}, "
+				"\"updated_ms\": %lld, \"icount\": {\"valid\": %s, \"rx\": %lld, \"tx\": %lld, "
+				"\"frame\": %lld, \"overrun\": %lld, \"parity\": %lld, \"brk\": %lld, "
+				"\"buf_overrun\": %lld}}\n",
+				m->port, (long long)m->rx_bytes, (long long)m->tx_bytes, (long long)m->rx_errors,
+				m->marked ? "true" : "false", (long long)m->line_errors, (long long)m->breaks,
+				(long long)m->updated_ms, m->icount_ok ? "true" : "false",
+				(long long)m->icount_rx, (long long)m->icount_tx, (long long)m->icount_frame,
+				(long long)m->icount_overrun, (long long)m->icount_parity,
+				(long long)m->icount_brk, (long long)m->icount_buf_overrun);
+	}
+
+	int n = snprintf(buf, len,
+			"# TYPE serial_rx_bytes_total counter\n"
+			"serial_rx_bytes_total{port=\"%s\"} %lld\n"
+			"# TYPE serial_tx_bytes_total counter\n"
+			"serial_tx_bytes_total{port=\"%s\"} %lld\n"
+			"# TYPE serial_rx_errors_total counter\n"
+			"serial_rx_errors_total{port=\"%s\"} %lld\n"
+			"# TYPE serial_updated_seconds gauge\n"
+			"serial_updated_seconds{port=\"%s\"} %.3f\n",
+			m->port, (long long)m->rx_bytes, m->port, (long long)m->tx_bytes,
+			m->port, (long long)m->rx_errors, m->port, m->updated_ms / 1000.0);
+
+	if (m->marked && n > 0 && n < len) {
+		n += snprintf(buf + n, len - n,
+				"# TYPE serial_marked_total counter\n"
+				"serial_marked_total{port=\"%s\",counter=\"line_errors\"} %lld\n"
+				"serial_marked_total{port=\"%s\",counter=\"breaks\"} %lld\n",
+				m->port, (long long)m->line_errors, m->port, (long long)m->breaks);
+	}
+
+	if (m->icount_ok && n > 0 && n < len) {
+		n += snprintf(buf + n, len - n,
+				"# TYPE serial_icount_total counter\n"
+				"serial_icount_total{port=\"%s\",counter=\"rx\"} %lld\n"
+				"serial_icount_total{port=\"%s\",counter=\"tx\"} %lld\n"
+				"serial_icount_total{port=\"%s\",counter=\"frame\"} %lld\n"
+				"serial_icount_total{port=\"%s\",counter=\"overrun\"} %lld\n"
+				"serial_icount_total{port=\"%s\",counter=\"parity\"} %lld\n"
+				"serial_icount_total{port=\"%s\",counter=\"brk\"} %lld\n"
+				"serial_icount_total{port=\"%s\",counter=\"buf_overrun\"} %lld\n",
+				m->port, (long long)m->icount_rx, m->port, (long long)m->icount_tx,
+				m->port, (long long)m->icount_frame, m->port, (long long)m->icount_overrun,
+				m->port, (long long)m->icount_parity, m->port, (long long)m->icount_brk,
+				m->port, (long long)m->icount_buf_overrun);
+	}
+
+	return n;
+}
+
+static void metrics_serve(int fd)
+{
+	struct metrics_block snap;
+	char buf[2048];
+	int n, off = 0;
+
+	metrics_snapshot(&snap);
+	n = metrics_format(buf, sizeof(buf), &snap);
+	if (n > (int)sizeof(buf) - 1)
+		n = sizeof(buf) - 1;
+
+	while (off < n) {
+		ssize_t c = send(fd, buf + off, n - off, MSG_NOSIGNAL);
+		if (c <= 0)
+			break;
+		off += c;
+	}
+	close(fd);
+}
+
+static void metrics_print_stats(void)
+{
+	struct metrics_block snap;
+
+	metrics_snapshot(&snap);
+	printf("%s: count for this session: rx=%lld, tx=%lld, rx err=%lld\n", snap.port,
+			(long long)snap.rx_bytes, (long long)snap.tx_bytes, (long long)snap.rx_errors);
+	if (snap.marked)
+		printf("%s: marked line errors: parity/frame=%lld, brk=%lld\n", snap.port,
+				(long long)snap.line_errors, (long long)snap.breaks);
+	if (snap.icount_ok)
+		printf("%s: TIOCGICOUNT: rx=%lld, tx=%lld, frame = %lld, overrun = %lld, parity = %lld, brk = %lld, buf_overrun = %lld\n",
+				snap.port, (long long)snap.icount_rx, (long long)snap.icount_tx,
+				(long long)snap.icount_frame, (long long)snap.icount_overrun,
+				(long long)snap.icount_parity, (long long)snap.icount_brk,
+				(long long)snap.icount_buf_overrun);
+	fflush(stdout);
+}
+
+static void *metrics_reporter(void *arg)
+{
+	struct timespec now, last_icount, last_stat;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	last_icount = now;
+	last_stat = now;
+	metrics_update_icount();
+
+	for (;;) {
+		struct pollfd fds[2];
+		int nfds = 1;
+
+		fds[0].fd = _metrics_wake[0];
+		fds[0].events = POLLIN;
+		if (_metrics_listen_fd >= 0) {
+			fds[1].fd = _metrics_listen_fd;
+			fds[1].events = POLLIN;
+			nfds++;
+		}
+
+		int ret = poll(fds, nfds, 1000);
+
+		if (ret > 0 && fds[0].revents)
+			break;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (diff_ms(&now, &last_icount) >= 1000) {
+			metrics_update_icount();
+			last_icount = now;
+		}
+
+		if (ret > 0 && nfds > 1 && (fds[1].revents & POLLIN)) {
+			int fd = accept(_metrics_listen_fd, NULL, NULL);
+			if (fd >= 0) {
+				// serve fresh hardware counters to every poller
+				metrics_update_icount();
+				metrics_serve(fd);
+			}
+		}
+
+		if (_cl_stats && diff_ms(&now, &last_stat) > 5000) {
+			metrics_print_stats();
+			last_stat = now;
+		}
+	}
+
+	return NULL;
+}
+
+static void metrics_start(const struct timespec *start)
+{
+	int ret;
+
+	if (_cl_metrics_shm) {
+		int fd = shm_open(_cl_metrics_shm, O_RDWR | O_CREAT, 0644);
+		if (fd < 0) {
+			ret = -errno;
+			perror("Error opening metrics shared memory");
+			exit(ret);
+		}
+		if (ftruncate(fd, sizeof(*_metrics)) < 0) {
+			ret = -errno;
+			perror("Error sizing metrics shared memory");
+			exit(ret);
+		}
+		_metrics = mmap(NULL, sizeof(*_metrics), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+	} else {
+		_metrics = mmap(NULL, sizeof(*_metrics), PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	}
+
+	if (_metrics == MAP_FAILED) {
+		ret = -errno;
+		_metrics = NULL;
+		perror("Error mapping metrics block");
+		exit(ret);
+	}
+
+	memset(_metrics, 0, sizeof(*_metrics));
+	_metrics->magic = METRICS_MAGIC;
+	_metrics->version = METRICS_VERSION;
+	_metrics->icount_ok = !_cl_no_icount;
+	_metrics->marked = _cl_mark_errors;
+	strncpy(_metrics->port, _cl_port, sizeof(_metrics->port) - 1);
+	_metrics_start = *start;
+
+	if (_cl_metrics_socket) {
+		struct sockaddr_un addr;
+
+		if (strlen(_cl_metrics_socket) >= sizeof(addr.sun_path)) {
+			fprintf(stderr, "ERROR: metrics socket path too long\n");
+			exit(-EINVAL);
+		}
+
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strcpy(addr.sun_path, _cl_metrics_socket);
+		unlink(_cl_metrics_socket);
+
+		_metrics_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (_metrics_listen_fd < 0 ||
+				bind(_metrics_listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+				listen(_metrics_listen_fd, 16) < 0) {
+			ret = -errno;
+			perror("Error creating metrics socket");
+			exit(ret);
+		}
+	}
+
+	if (pipe(_metrics_wake) < 0) {
+		ret = -errno;
+		perror("Error creating metrics pipe");
+		exit(ret);
+	}
+
+	ret = pthread_create(&_metrics_thread, NULL, metrics_reporter, NULL);
+	if (ret) {
+		fprintf(stderr, "ERROR: cannot start metrics thread: %s\n", strerror(ret));
+		exit(-ret);
+	}
+	_metrics_thread_running = 1;
+
+	metrics_publish(start);
+}
+
+static void metrics_stop(void)
+{
+	if (_metrics_thread_running) {
+		if (write(_metrics_wake[1], "", 1) == 1)
+			pthread_join(_metrics_thread, NULL);
+		_metrics_thread_running = 0;
+	}
+
+	if (_metrics_listen_fd >= 0) {
+		close(_metrics_listen_fd);
+		_metrics_listen_fd = -1;
+		unlink(_cl_metrics_socket);
+	}
+
+	if (_cl_metrics_shm && _metrics) {
+		shm_unlink(_cl_metrics_shm);
+	}
+}
+
+/*
+ * Performance baseline. The summary metrics of a run can be saved to a
+ * file and later runs compared against it. A metric that got worse by
+ * more than its tolerance is a performance regression, reported with its
+ * own exit status so it can be told apart from data errors.
+ *
+ * Exit status: 0-125 is the number of data errors (capped at 125), and
+ * the statuses below are outside that range and clear of the shell's
+ * 126/127 and of 128 + signal number.
+ */
+#define EXIT_PERF_REGRESSION	200	/* a metric is worse than its tolerance */
+#define EXIT_BASELINE_UNREADABLE	201	/* the baseline file cannot be read */
+#define EXIT_BASELINE_UNMEASURED	202	/* a baseline metric was not measured in this run */
+#define EXIT_BASELINE_UNWRITABLE	203	/* the baseline file cannot be written */
+#define BASELINE_DEFAULT_TOLERANCE	5.0	/* percent */
+
+struct summary_metric {
+	const char *name;
+	int higher_is_better;
+	double tolerance;	/* percent, < 0 to use the default */
+	double value;		/* < 0 if not measured in this run */
+};
+
+static struct summary_metric _summary[] = {
+	{ "tx_bytes_per_s", 1, -1, -1 },
+	{ "rx_bytes_per_s", 1, -1, -1 },
+	{ "cpu_ns_per_byte", 0, -1, -1 },
+	{ "rx_buffer_delay_us", 0, -1, -1 },
+};
+
+#define SUMMARY_METRICS	(sizeof(_summary) / sizeof(_summary[0]))
+
+static double _baseline_tolerance = BASELINE_DEFAULT_TOLERANCE;
+
+static struct summary_metric *summary_find(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < SUMMARY_METRICS; i++)
+		if (!strcmp(_summary[i].name, name))
+			return &_summary[i];
+	return NULL;
+}
+
+// "10" sets the default, "10,cpu_ns_per_byte=20" also one metric
+static void baseline_parse_tolerance(const char *arg)
+{
+	char *list = strdup(arg), *save = NULL, *tok;
+
+	for (tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		char *eq = strchr(tok, '=');
+
+		if (!eq) {
+			_baseline_tolerance = strtod(tok, NULL);
+			continue;
+		}
+
+		*eq = 0;
+		struct summary_metric *m = summary_find(tok);
+		if (!m) {
+			fprintf(stderr, "ERROR: unknown baseline metric %s\n", tok);
+			exit(-EINVAL);
+		}
+		m->tolerance = strtod(eq + 1, NULL);
+	}
+
+	free(list);
+}
+
+static void summary_collect(const struct run_rate *tx, const struct run_rate *rx)
+{
+	struct rusage ru;
+
+	summary_find("tx_bytes_per_s")->value = run_rate_value(tx);
+	summary_find("rx_bytes_per_s")->value = run_rate_value(rx);
+
+	if (getrusage(RUSAGE_SELF, &ru) == 0 && tx->bytes + rx->bytes > 0) {
+		double cpu_ns = (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1e9 +
+			(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1e3;
+
+		summary_find("cpu_ns_per_byte")->value = cpu_ns / (tx->bytes + rx->bytes);
+	}
+
+	if (_cl_rx_profile)
+		summary_find("rx_buffer_delay_us")->value = rx_profile_delay_us();
+}
+
+// returns 0 or EXIT_BASELINE_UNWRITABLE
+static int baseline_save(const char *path)
+{
+	FILE *f = fopen(path, "w");
+	unsigned int i;
+
+	if (!f) {
+		perror("Error writing baseline file");
+		return EXIT_BASELINE_UNWRITABLE;
+	}
+
+	fprintf(f, "# linux-serial-test baseline for %s at %d baud\n", _cl_port, _cl_baud ? _cl_baud : 115200);
+	for (i = 0; i < SUMMARY_METRICS; i++)
+		if (_summary[i].value >= 0)
+			fprintf(f, "%s %.6f\n", _summary[i].name, _summary[i].value);
+
+	if (fclose(f)) {
+		perror("Error writing baseline file");
+		return EXIT_BASELINE_UNWRITABLE;
+	}
+	printf("%s: baseline saved to %s\n", _cl_port, path);
+	return 0;
+}
+
+// returns 0 or one of the EXIT_ statuses above
+static int baseline_compare(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	char line[256];
+	int regressed = 0, unmeasured = 0;
+
+	if (!f) {
+		perror("Error reading baseline file");
+		return EXIT_BASELINE_UNREADABLE;
+	}
+
+	printf("%s: %-20s %16s %16s %9s %9s\n", _cl_port, "baseline metric", "baseline", "this run",
+			"change", "tolerance");
+
+	while (fgets(line, sizeof(line), f)) {
+		char name[64];
+		double base;
+
+		if (line[0] == '#' || sscanf(line, "%63s %lf", name, &base) != 2)
+			continue;
+
+		struct summary_metric *m = summary_find(name);
+		if (!m || m->value < 0) {
+			printf("%s: %-20s %16.3f %16s\n", _cl_port, name, base, "NOT MEASURED");
+			unmeasured = 1;
+			continue;
+		}
+
+		double tol = m->tolerance >= 0 ? m->tolerance : _baseline_tolerance;
+		double change = base ? (m->value - base) * 100 / base : 0;
+		double worse = m->higher_is_better ? -change : change;
+		const char *verdict = "ok";
+
+		if (worse > tol) {
+			verdict = "REGRESSION";
+			regressed = 1;
+		} else if (worse < -tol) {
+			verdict = "improved";
+		}
+
+		printf("%s: %-20s %16.3f %16.3f %+8.2f%% %8.1f%% %s\n", _cl_port, name, base, m->value,
+				change, tol, verdict);
+	}
+
+	fclose(f);
+	if (regressed)
+		return EXIT_PERF_REGRESSION;
+	return unmeasured ? EXIT_BASELINE_UNMEASURED : 0;
+}
+
+static void open_serial_port(void)
+{
+	int baud = B115200;
+
+	if (_cl_baud && !_cl_divisor)
+		baud = get_baud(_cl_baud);
+
+	if (baud <= 0 || _cl_divisor) {
+		if (!_open_step_ns)
+			printf("NOTE: non standard baud rate, trying custom divisor\n");
+		setup_serial_port(B38400);
+		set_baud_divisor(_cl_baud, _cl_divisor);
+	} else {
+		setup_serial_port(baud);
+		/*
+		 * The flag ASYNC_SPD_CUST might have already been set, so
+		 * clear it to avoid confusing the kernel uart dirver.
+		 */
+		clear_custom_speed_flag();
+	}
+
+	open_step_begin();
+	set_modem_lines(_fd, _cl_loopback ? TIOCM_LOOP : 0, TIOCM_LOOP);
+}
+
+static double step_ns(const struct timespec *t1, const struct timespec *t2)
+{
+	return (t1->tv_sec - t2->tv_sec) * 1e9 + (t1->tv_nsec - t2->tv_nsec);
+}
+
+/*
+ * One open/configure/close cycle. If receiving, the time until the first
+ * byte arrives is measured as well; unless transmitting is disabled a byte
+ * is sent for that, so it needs a loopback or a peer that answers.
+ */
+static void open_bench_iteration(void)
+{
+	struct timespec start, now;
+	unsigned char b = 0x55;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	open_serial_port();
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	_open_step_ns[STEP_CONFIGURED] = step_ns(&now, &start);
+
+	if (!_cl_no_rx) {
+		struct pollfd pfd = { .fd = _fd, .events = POLLIN };
+
+		if (!_cl_no_tx && write(_fd, &b, 1) != 1)
+			perror("open bench: write");
+
+		if (poll(&pfd, 1, _cl_rx_timeout_ms) > 0 && read(_fd, &b, 1) == 1) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			_open_step_ns[STEP_FIRST_BYTE] = step_ns(&now, &start);
+		}
+	}
+
+	open_step_begin();
+	flock(_fd, LOCK_UN);
+	close(_fd);
+	_fd = -1;
+	open_step_done(STEP_CLOSE);
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void open_bench_report(const char *port, const double *results, int iterations)
+{
+	double *v = malloc(iterations * sizeof(*v));
+	int step, i;
+
+	if (!v) {
+		fprintf(stderr, "ERROR: Memory allocation failed\n");
+		exit(-ENOMEM);
+	}
+
+	printf("%s: open bench, %d iterations, times in us\n", port, iterations);
+	printf("%s: %-20s %6s %10s %10s %10s %10s %10s\n", port, "step", "n", "min", "p50", "p90",
+			"p99", "max");
+
+	for (step = 0; step < OPEN_STEPS; step++) {
+		int n = 0;
+
+		for (i = 0; i < iterations; i++)
+			if (results[i * OPEN_STEPS + step] >= 0)
+				v[n++] = results[i * OPEN_STEPS + step] / 1000;
+
+		if (step == STEP_FIRST_BYTE && !_cl_no_rx && n < iterations)
+			printf("%s: first byte not received within %dms in %d of %d iterations\n", port,
+					_cl_rx_timeout_ms, iterations - n, iterations);
+		if (!n)
+			continue;
+
+		qsort(v, n, sizeof(*v), cmp_double);
+		printf("%s: %-20s %6d %10.1f %10.1f %10.1f %10.1f %10.1f\n", port, open_step_names[step], n,
+				v[0], v[n * 50 / 100], v[n * 90 / 100], v[n * 99 / 100], v[n - 1]);
+	}
+
+	free(v);
+}
+
+/*
+ * Repeatedly open, configure and close the port, timing each step. -p may
+ * list several ports separated by commas; each one is run in its own
+ * process at the same time, with the results in shared memory.
+ */
+static int open_bench(void)
+{
+	char *ports = strdup(_cl_port), *save = NULL, *port;
+	char **names = NULL;
+	pid_t *pids;
+	int nports = 0, p, i, failed = 0, ret;
+
+	for (port = strtok_r(ports, ",", &save); port; port = strtok_r(NULL, ",", &save)) {
+		names = realloc(names, (nports + 1) * sizeof(*names));
+		if (!names) {
+			fprintf(stderr, "ERROR: Memory allocation failed\n");
+			exit(-ENOMEM);
+		}
+		names[nports++] = port;
+	}
+
+	size_t per_port = (size_t)_cl_open_bench * OPEN_STEPS;
+	size_t size = nports * per_port * sizeof(double);
+	double *results = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+	pids = calloc(nports, sizeof(*pids));
+	if (results == MAP_FAILED || !pids) {
+		fprintf(stderr, "ERROR: Memory allocation failed\n");
+		exit(-ENOMEM);
+	}
+
+	for (i = 0; i < nports * per_port; i++)
+		results[i] = -1;
+
+	fflush(stdout);
+	for (p = 0; p < nports; p++) {
+		pids[p] = fork();
+		if (pids[p] < 0) {
+			ret = -errno;
+			perror("fork");
+			exit(ret);
+		}
+		if (pids[p] == 0) {
+			_cl_port = strdup(names[p]);
+			for (i = 0; i < _cl_open_bench && !sigint_received; i++) {
+				_open_step_ns = results + p * per_port + i * OPEN_STEPS;
+				open_bench_iteration();
+			}
+			fflush(stdout);
+			_exit(0);
+		}
+	}
+
+	for (p = 0; p < nports; p++) {
+		int status;
+
+		waitpid(pids[p], &status, 0);
+		// reuse the pid slot to remember which ports failed
+		pids[p] = !WIFEXITED(status) || WEXITSTATUS(status);
+		failed |= pids[p];
+	}
+
+	for (p = 0; p < nports; p++) {
+		if (pids[p])
+			printf("%s: open bench failed\n", names[p]);
+		else
+			open_bench_report(names[p], results + p * per_port, _cl_open_bench);
+	}
+
+	munmap(results, size);
+	free(pids);
+	free(names);
+	free(ports);
+
+	return failed ? -EIO : 0;
+}
+
+/*
+ * Read wakeup characterization (--wakeup-sweep). The same paced traffic,
+ * bursts of -w bytes every -a ms, is received under several read policies
+ * in turn. For each one the CPU time of the RX thread, the number of RX
+ * wakeups and the delivery latency of each burst (from just before its
+ * write() to the read that completes it) are measured. TX runs in its own
+ * thread so that the RX side can block in read(), and its CPU time is left
+ * out.
+ */
+#define SWEEP_DEFAULT_POLICIES	"block:1:0,block:32:1,block:128:5,poll,busy,timer:1,timer:10"
+#define SWEEP_DEFAULT_BURST	16
+#define SWEEP_DEFAULT_INTERVAL_MS	10
+#define SWEEP_DEFAULT_TIME_MS	2000
+
+enum {
+	WAKEUP_BLOCK,	/* blocking read() with VMIN/VTIME */
+	WAKEUP_POLL,	/* poll() then non-blocking read() */
+	WAKEUP_BUSY,	/* non-blocking read() in a loop */
+	WAKEUP_TIMER,	/* read everything available on each timer tick */
+};
+
+struct wakeup_policy {
+	char name[32];
+	int kind;
+	int vmin;
+	int vtime;
+	int timer_ms;
+	// results
+	double cpu_pct;
+	double wakeups_per_s;
+	double lat_p50_us;
+	double lat_p99_us;
+	double lat_max_us;
+	long long int bytes;
+	long long int errors;
+	int pareto;
+};
+
+static volatile int _sweep_stop = 0;
+static volatile int _sweep_rx_done = 0;
+static int _sweep_burst;
+static int _sweep_interval_ms;
+static int _sweep_time_ms;
+static int _sweep_grace_ms;	/* for RX to get the last burst */
+static struct timespec *_sweep_sent;	/* time of each burst's write() */
+static int _sweep_bursts_sent;
+static int _sweep_max_bursts;
+static pthread_t _sweep_rx_thread;
+
+static void *sweep_tx(void *arg)
+{
+	unsigned char *buf = malloc(_sweep_burst);
+	struct timespec start, next, now;
+	int i;
+
+	if (!buf) {
+		fprintf(stderr, "ERROR: Memory allocation failed\n");
+		exit(-ENOMEM);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	next = start;
+
+	for (i = 0; i < _sweep_max_bursts && !sigint_received; i++) {
+		int off = 0;
+
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+		_write_count_value = pattern_fill(buf, _sweep_burst, _write_count_value, _cl_ascii_range);
+		clock_gettime(CLOCK_MONOTONIC, &_sweep_sent[i]);
+		__atomic_store_n(&_sweep_bursts_sent, i + 1, __ATOMIC_RELEASE);
+
+		while (off < _sweep_burst) {
+			ssize_t c = write(_fd, buf + off, _sweep_burst - off);
+
+			if (c > 0) {
+				off += c;
+			} else if (c < 0 && errno == EAGAIN) {
+				struct pollfd pfd = { .fd = _fd, .events = POLLOUT };
+				poll(&pfd, 1, 100);
+			} else if (c < 0 && errno != EINTR) {
+				perror("wakeup sweep: write");
+				break;
+			}
+		}
+		_write_count += off;
+
+		next.tv_nsec += _sweep_interval_ms * 1000000L;
+		while (next.tv_nsec >= 1000000000) {
+			next.tv_sec++;
+			next.tv_nsec -= 1000000000;
+		}
+	}
+
+	// give RX time to get the rest, then stop it
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		usleep(1000);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	} while (__atomic_load_n(&_read_count, __ATOMIC_RELAXED) < _write_count &&
+			diff_ms(&now, &start) < _sweep_grace_ms);
+
+	stop_thread(_sweep_rx_thread, &_sweep_stop, &_sweep_rx_done);
+
+	free(buf);
+	return NULL;
+}
+
+static int sweep_configure(const struct wakeup_policy *p)
+{
+	struct termios tio;
+	int flags = fcntl(_fd, F_GETFL);
+
+	if (p->kind == WAKEUP_BLOCK)
+		flags &= ~O_NONBLOCK;
+	else
+		flags |= O_NONBLOCK;
+	if (fcntl(_fd, F_SETFL, flags) < 0 || tcgetattr(_fd, &tio) < 0) {
+		perror("wakeup sweep: configure");
+		return -1;
+	}
+
+	tio.c_cc[VMIN] = p->kind == WAKEUP_BLOCK ? p->vmin : 128;
+	tio.c_cc[VTIME] = p->kind == WAKEUP_BLOCK ? p->vtime : 5;
+	tcsetattr(_fd, TCSANOW, &tio);
+	tcflush(_fd, TCIOFLUSH);
+	return 0;
+}
+
+static void sweep_run(struct wakeup_policy *p)
+{
+	unsigned char rb[READ_BUFFER_SIZE];
+	struct rusage ru0, ru1;
+	struct timespec t0, t1, now;
+	pthread_t tx;
+	long long int wakeups = 0;
+	double *lat = malloc(_sweep_max_bursts * sizeof(*lat));
+	int nlat = 0, timer_fd = -1, ret;
+
+	if (!lat) {
+		fprintf(stderr, "ERROR: Memory allocation failed\n");
+		exit(-ENOMEM);
+	}
+
+	if (sweep_configure(p) < 0)
+		exit(-EIO);
+	// a second, plus one timer tick for the batched reads
+	_sweep_grace_ms = 1000 + (p->kind == WAKEUP_TIMER ? p->timer_ms : 0);
+
+	if (p->kind == WAKEUP_TIMER) {
+		struct itimerspec its = { 0 };
+
+		timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+		its.it_value.tv_sec = p->timer_ms / 1000;
+		its.it_value.tv_nsec = (p->timer_ms % 1000) * 1000000L;
+		its.it_interval = its.it_value;
+		if (timer_fd < 0 || timerfd_settime(timer_fd, 0, &its, NULL) < 0) {
+			perror("wakeup sweep: timerfd");
+			exit(-EIO);
+		}
+	}
+
+	_read_count = _write_count = _error_count = 0;
+	_read_count_value = _write_count_value = _cl_ascii_range ? PATTERN_ASCII_FIRST : 0;
+	_sweep_bursts_sent = 0;
+	_sweep_stop = 0;
+	_sweep_rx_done = 0;
+
+	getrusage(RUSAGE_THREAD, &ru0);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	ret = pthread_create(&tx, NULL, sweep_tx, NULL);
+	if (ret) {
+		fprintf(stderr, "ERROR: cannot start tx thread: %s\n", strerror(ret));
+		exit(-ret);
+	}
+
+	while (!_sweep_stop) {
+		int c;
+
+		if (p->kind == WAKEUP_POLL) {
+			struct pollfd pfd = { .fd = _fd, .events = POLLIN };
+
+			if (poll(&pfd, 1, 1000) <= 0)
+				continue;
+		} else if (p->kind == WAKEUP_TIMER) {
+			uint64_t ticks;
+
+			if (read(timer_fd, &ticks, sizeof(ticks)) < 0)
+				continue;
+		}
+		// busy polling never sleeps, only reads with data count
+		if (p->kind != WAKEUP_BUSY)
+			wakeups++;
+
+		// blocking policies read once per wakeup, the others drain
+		do {
+			c = read(_fd, rb, sizeof(rb));
+			if (c <= 0)
+				break;
+			if (p->kind == WAKEUP_BUSY)
+				wakeups++;
+
+			_rx_kernel(rb, c);
+			__atomic_store_n(&_read_count, _read_count + c, __ATOMIC_RELAXED);
+
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			int sent = __atomic_load_n(&_sweep_bursts_sent, __ATOMIC_ACQUIRE);
+			while (nlat < sent && _read_count >= (long long int)(nlat + 1) * _sweep_burst) {
+				lat[nlat] = (now.tv_sec - _sweep_sent[nlat].tv_sec) * 1e6 +
+					(now.tv_nsec - _sweep_sent[nlat].tv_nsec) / 1e3;
+				nlat++;
+			}
+		} while (p->kind != WAKEUP_BLOCK && p->kind != WAKEUP_BUSY);
+	}
+	_sweep_rx_done = 1;
+	pthread_join(tx, NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	getrusage(RUSAGE_THREAD, &ru1);
+
+	double wall = diff_s(&t1, &t0);
+	double cpu = (ru1.ru_utime.tv_sec - ru0.ru_utime.tv_sec) + (ru1.ru_stime.tv_sec - ru0.ru_stime.tv_sec) +
+		((ru1.ru_utime.tv_usec - ru0.ru_utime.tv_usec) + (ru1.ru_stime.tv_usec - ru0.ru_stime.tv_usec)) / 1e6;
+
+	p->cpu_pct = 100 * cpu / wall;
+	p->wakeups_per_s = wakeups / wall;
+	p->bytes = _read_count;
+	p->errors = _error_count + llabs(_write_count - _read_count);
+	p->lat_p50_us = p->lat_p99_us = p->lat_max_us = -1;
+	if (nlat) {
+		qsort(lat, nlat, sizeof(*lat), cmp_double);
+		p->lat_p50_us = lat[nlat * 50 / 100];
+		p->lat_p99_us = lat[nlat * 99 / 100];
+		p->lat_max_us = lat[nlat - 1];
+	}
+
+	if (timer_fd >= 0)
+		close(timer_fd);
+	free(lat);
+}
+
+static int sweep_parse(const char *list, struct wakeup_policy **policies)
+{
+	char *copy = strdup(list), *save = NULL, *tok;
+	int n = 0;
+
+	for (tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		struct wakeup_policy p;
+
+		memset(&p, 0, sizeof(p));
+		if (sscanf(tok, "block:%d:%d", &p.vmin, &p.vtime) == 2) {
+			p.kind = WAKEUP_BLOCK;
+			snprintf(p.name, sizeof(p.name), "block vmin=%d vtime=%d", p.vmin, p.vtime);
+		} else if (!strcmp(tok, "poll")) {
+			p.kind = WAKEUP_POLL;
+			snprintf(p.name, sizeof(p.name), "poll");
+		} else if (!strcmp(tok, "busy")) {
+			p.kind = WAKEUP_BUSY;
+			snprintf(p.name, sizeof(p.name), "busy");
+		} else if (sscanf(tok, "timer:%d", &p.timer_ms) == 1 && p.timer_ms > 0) {
+			p.kind = WAKEUP_TIMER;
+			snprintf(p.name, sizeof(p.name), "timer %dms", p.timer_ms);
+		} else {
+			fprintf(stderr, "ERROR: unknown read policy %s\n", tok);
+			exit(-EINVAL);
+		}
+
+		*policies = realloc(*policies, (n + 1) * sizeof(**policies));
+		if (!*policies) {
+			fprintf(stderr, "ERROR: Memory allocation failed\n");
+			exit(-ENOMEM);
+		}
+		(*policies)[n++] = p;
+	}
+
+	free(copy);
+	return n;
+}
+
+static int wakeup_sweep(void)
+{
+	struct wakeup_policy *policies = NULL;
+	int n, i, j;
+	long long int errors = 0;
+
+	if (_payload) {
+		fprintf(stderr, "ERROR: --wakeup-sweep uses the counting pattern, not --payload\n");
+		exit(-EINVAL);
+	}
+
+	n = sweep_parse(*_cl_wakeup_sweep ? _cl_wakeup_sweep : SWEEP_DEFAULT_POLICIES, &policies);
+	_sweep_burst = _cl_tx_bytes ? _cl_tx_bytes : SWEEP_DEFAULT_BURST;
+	_sweep_interval_ms = _cl_tx_delay ? _cl_tx_delay : SWEEP_DEFAULT_INTERVAL_MS;
+	_sweep_time_ms = _cl_tx_time_ms ? _cl_tx_time_ms : SWEEP_DEFAULT_TIME_MS;
+	_sweep_max_bursts = _sweep_time_ms / _sweep_interval_ms + 1;
+	_sweep_sent = calloc(_sweep_max_bursts, sizeof(*_sweep_sent));
+	if (!_sweep_sent) {
+		fprintf(stderr, "ERROR: Memory allocation failed\n");
+		exit(-ENOMEM);
+	}
+
+	catch_sigusr2();
+	_sweep_rx_thread = pthread_self();
+
+	printf("%s: wakeup sweep, %d byte bursts every %dms for %.1fs per policy (%dus per char)\n",
+			_cl_port, _sweep_burst, _sweep_interval_ms, _sweep_time_ms / 1000.0, char_time_us());
+
+	for (i = 0; i < n && !sigint_received; i++) {
+		printf("%s: running %s\n", _cl_port, policies[i].name);
+		fflush(stdout);
+		sweep_run(&policies[i]);
+		errors += policies[i].errors;
+	}
+	n = i;
+
+	// a policy is on the Pareto front if no other one has both less CPU and less latency
+	for (i = 0; i < n; i++) {
+		policies[i].pareto = policies[i].lat_p50_us >= 0;
+		for (j = 0; j < n && policies[i].pareto; j++) {
+			if (j == i || policies[j].lat_p50_us < 0)
+				continue;
+			if (policies[j].cpu_pct <= policies[i].cpu_pct &&
+					policies[j].lat_p50_us <= policies[i].lat_p50_us &&
+					(policies[j].cpu_pct < policies[i].cpu_pct ||
+					 policies[j].lat_p50_us < policies[i].lat_p50_us))
+				policies[i].pareto = 0;
+		}
+	}
+
+	printf("%s: %-22s %7s %10s %10s %10s %10s %10s %7s %s\n", _cl_port, "policy", "cpu %",
+			"wakeups/s", "lat p50", "lat p99", "lat max", "rx bytes", "errors", "pareto");
+	for (i = 0; i < n; i++) {
+		struct wakeup_policy *p = &policies[i];
+
+		printf("%s: %-22s %7.2f %10.1f %8.0fus %8.0fus %8.0fus %10lld %7lld %s\n", _cl_port, p->name,
+				p->cpu_pct, p->wakeups_per_s, p->lat_p50_us, p->lat_p99_us, p->lat_max_us,
+				p->bytes, p->errors, p->pareto ? "*" : "");
+	}
+
+	free(_sweep_sent);
+	free(policies);
+
+	return errors > 125 ? 125 : errors;
+}
+
+/*
+ * Fault injecting virtual link (--fault-link). The test runs as usual on the
+ * slave side of a pseudo-terminal, and a thread on the master side loops
+ * the data back through a seeded fault model:
+ *  - drop, flip, insert: a byte is lost, has one bit flipped, or gets a
+ *    random byte inserted before it
+ *  - delay: the data just taken from the port is held back for a while
+ *  - stall: nothing is taken from the port for a while, so the sender
+ *    backs up as if CTS was deasserted
+ *  - rate: the loopback passes at most this many bytes per second
+ * Data faults are at least FAULT_MIN_GAP bytes apart so each one leaves
+ * its own footprint in the checker. Every data fault is logged with its
+ * offset in the looped back stream, which is the ground truth the error
+ * classification is compared with at the end.
+ */
+#define FAULT_MIN_GAP	4
+#define FAULT_BUFFER_SIZE	4096
+
+enum {
+	FAULT_DROP,
+	FAULT_FLIP,
+	FAULT_INSERT,
+	FAULT_DELAY,
+	FAULT_STALL,
+	FAULT_KINDS,
+};
+
+static const char *_fault_names[FAULT_KINDS] = { "drop", "flip", "insert", "delay", "stall" };
+
+struct fault_event {
+	long long int offset;
+	int kind;
+};
+
+static double _fault_p[FAULT_KINDS];
+static int _fault_ms[FAULT_KINDS];
+static long long int _fault_rate;
+static uint64_t _fault_threshold[FAULT_KINDS];	/* cumulative, for one random draw per byte */
+static uint64_t _fault_rng;
+static int _fault_master = -1;
+static pthread_t _fault_thread;
+static volatile int _fault_stop = 0;
+static volatile int _fault_done = 0;
+static struct fault_event *_fault_log;
+static long long int _fault_log_count;
+static long long int _fault_log_size;
+static long long int _fault_events[FAULT_KINDS];
+static long long int _fault_out_bytes;
+
+// xorshift64*, the same sequence everywhere for a given seed
+static uint64_t fault_random(void)
+{
+	_fault_rng ^= _fault_rng >> 12;
+	_fault_rng ^= _fault_rng << 25;
+	_fault_rng ^= _fault_rng >> 27;
+	return _fault_rng * 0x2545f4914f6cdd1dULL;
+}
+
+static void fault_parse(const char *spec)
+{
+	char *copy = strdup(spec), *save = NULL, *tok;
+	double total = 0;
+	int i;
+
+	for (tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		char name[16];
+		double p;
+		int ms = 0, n;
+
+		if (sscanf(tok, "rate=%lld", &_fault_rate) == 1)
+			continue;
+
+		n = sscanf(tok, "%15[a-z]=%lf:%d", name, &p, &ms);
+		for (i = 0; i < FAULT_KINDS && n >= 2; i++)
+			if (!strcmp(name, _fault_names[i]))
+				break;
+		if (n < 2 || i == FAULT_KINDS || p < 0 || (i >= FAULT_DELAY && (n != 3 || ms <= 0))) {
+			fprintf(stderr, "ERROR: bad fault %s, use drop=P, flip=P, insert=P, delay=P:MS, stall=P:MS or rate=BYTES_PER_S\n",
+					tok);
+			exit(-EINVAL);
+		}
+		_fault_p[i] = p;
+		_fault_ms[i] = ms;
+	}
+	free(copy);
+
+	for (i = 0; i < FAULT_KINDS; i++) {
+		total += _fault_p[i];
+		if (total >= 1) {
+			fprintf(stderr, "ERROR: fault probabilities must add up to less than 1\n");
+			exit(-EINVAL);
+		}
+		_fault_threshold[i] = total * 18446744073709551616.0;
+	}
+}
 
-	// 0.5 seconds read timeout
-	newtio.c_cc[VTIME] = 5;
+static void fault_log(int kind)
+{
+	if (_fault_log_count == _fault_log_size) {
+		_fault_log_size = _fault_log_size ? 2 * _fault_log_size : 4096;
+		_fault_log = realloc(_fault_log, _fault_log_size * sizeof(*_fault_log));
+		if (!_fault_log) {
+			fprintf(stderr, "ERROR: Memory allocation failed\n");
+			exit(-ENOMEM);
+		}
+	}
+	_fault_log[_fault_log_count].offset = _fault_out_bytes;
+	_fault_log[_fault_log_count].kind = kind;
+	_fault_log_count++;
+}
 
-	/* now clean the modem line and activate the settings for the port */
-	tcflush(_fd, TCIOFLUSH);
-	tcsetattr(_fd,TCSANOW,&newtio);
+static void fault_sleep(int ms)
+{
+	struct timespec t = { ms / 1000, (ms % 1000) * 1000000L };
 
-	/* enable/disable rs485 direction control, first check if RS485 is supported */
-	if(ioctl(_fd, TIOCGRS485, &rs485) < 0) {
-		if (_cl_rs485) {
-			/* error could be because hardware is missing rs485 support so only print when actually trying to activate it */
-			perror("Error getting RS-485 mode");
+	while (!_fault_stop && nanosleep(&t, &t) < 0 && errno == EINTR)
+		;
+}
+
+static void *fault_link_thread(void *arg)
+{
+	unsigned char in[FAULT_BUFFER_SIZE], out[2 * FAULT_BUFFER_SIZE];
+	size_t chunk = sizeof(in);
+	long long int gap = 0;
+	struct timespec start, next;
+	int i;
+
+	// with a rate limit, take small pieces so the pace is even
+	if (_fault_rate && _fault_rate / 100 < (long long int)chunk)
+		chunk = _fault_rate / 100 ? _fault_rate / 100 : 1;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (!_fault_stop) {
+		int delay = 0, stall = 0, o = 0, c;
+
+		c = read(_fault_master, in, chunk);
+		if (c <= 0) {
+			if (c < 0 && (errno == EINTR || errno == EAGAIN))
+				continue;
+			break;	// the slave side was closed
 		}
-	} else {
-		if (_cl_rs485) {
-			/* Default to 0 if not specified */
-			if (_cl_rs485_after_delay < 0)
-				_cl_rs485_after_delay = 0;
 
-			/* Skip reconfiguration if already enabled with default delays */
-			if (rs485.flags & SER_RS485_ENABLED) {
-				printf("RS485 already enabled on port with default settings\n");
-			} else {
-				/* enable RS485 */
-				rs485.flags |= SER_RS485_ENABLED | SER_RS485_RX_DURING_TX |
-							   (_cl_rs485_rts_after_send ? SER_RS485_RTS_AFTER_SEND : SER_RS485_RTS_ON_SEND);
-				rs485.flags &= ~(_cl_rs485_rts_after_send ? SER_RS485_RTS_ON_SEND : SER_RS485_RTS_AFTER_SEND);
-				rs485.delay_rts_after_send = _cl_rs485_after_delay;
-				rs485.delay_rts_before_send = _cl_rs485_before_delay;
-				if (ioctl(_fd, TIOCSRS485, &rs485) < 0) {
-					perror("Error setting RS-485 mode");
-				}
+		for (i = 0; i < c; i++) {
+			uint64_t r = fault_random();
+			int kind;
+
+			gap++;
+			for (kind = 0; kind < FAULT_KINDS; kind++)
+				if (r < _fault_threshold[kind])
+					break;
+
+			if (kind <= FAULT_INSERT && gap < FAULT_MIN_GAP)
+				kind = FAULT_KINDS;
+
+			switch (kind) {
+			case FAULT_DROP:
+				// the error shows up at the next byte passed on
+				fault_log(kind);
+				gap = 0;
+				continue;
+			case FAULT_FLIP:
+				fault_log(kind);
+				out[o++] = in[i] ^ (1 << (fault_random() % 8));
+				_fault_out_bytes++;
+				gap = 0;
+				continue;
+			case FAULT_INSERT: {
+				unsigned char x;
+
+				// a copy of the expected byte or of one that the pattern
+				// continues with it would not be noticed
+				do {
+					x = fault_random();
+				} while (x == in[i] || next_count_value(x, _cl_ascii_range) == in[i]);
+				fault_log(kind);
+				out[o++] = x;
+				_fault_out_bytes++;
+				gap = 0;
+				break;
+			}
+			case FAULT_DELAY:
+				_fault_events[kind]++;
+				delay = 1;
+				break;
+			case FAULT_STALL:
+				_fault_events[kind]++;
+				stall = 1;
+				break;
 			}
+			out[o++] = in[i];
+			_fault_out_bytes++;
+		}
+
+		if (delay)
+			fault_sleep(_fault_ms[FAULT_DELAY]);
+
+		for (i = 0; i < o && !_fault_stop; ) {
+			c = write(_fault_master, out + i, o - i);
+			if (c > 0)
+				i += c;
+			else if (c < 0 && errno != EINTR && errno != EAGAIN)
+				break;
+		}
+
+		if (_fault_rate) {
+			long long int ns = _fault_out_bytes * 1000000000LL / _fault_rate;
+
+			next.tv_sec = start.tv_sec + (start.tv_nsec + ns) / 1000000000;
+			next.tv_nsec = (start.tv_nsec + ns) % 1000000000;
+			while (!_fault_stop && clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR)
+				;
+		}
+
+		if (stall)
+			fault_sleep(_fault_ms[FAULT_STALL]);
+	}
+
+	_fault_done = 1;
+	return NULL;
+}
+
+static void fault_link_start(void)
+{
+	char *name;
+	int ret;
+
+	if (_cl_port) {
+		fprintf(stderr, "ERROR: --fault-link provides the port, do not use -p\n");
+		exit(-EINVAL);
+	}
+	if (_cl_payload) {
+		fprintf(stderr, "ERROR: --fault-link needs the counting pattern, not --payload\n");
+		exit(-EINVAL);
+	}
+
+	fault_parse(_cl_fault_link);
+	if (_cl_fault_seed < 0)
+		_cl_fault_seed = time(NULL) ^ ((long long int)getpid() << 16);
+	// xorshift must not start at 0
+	_fault_rng = _cl_fault_seed ? _cl_fault_seed : 1;
+
+	_fault_master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (_fault_master < 0 || grantpt(_fault_master) < 0 || unlockpt(_fault_master) < 0 ||
+			!(name = ptsname(_fault_master))) {
+		ret = -errno;
+		perror("fault link: pseudo-terminal");
+		exit(ret);
+	}
+	_cl_port = strdup(name);
+
+	// a pseudo-terminal has no modem lines or interrupt counters
+	_cl_do_not_touch_modem_lines = 1;
+	_cl_no_icount = 1;
+
+	catch_sigusr2();
+	ret = pthread_create(&_fault_thread, NULL, fault_link_thread, NULL);
+	if (ret) {
+		fprintf(stderr, "ERROR: cannot start fault link thread: %s\n", strerror(ret));
+		exit(-ret);
+	}
+
+	printf("%s: fault link, seed %lld\n", _cl_port, _cl_fault_seed);
+}
+
+// stop the link and compare the classified errors with the injected faults
+static int fault_link_report(void)
+{
+	long long int injected[FAULT_KINDS] = { 0 };
+	long long int i;
+	int pass;
+
+	stop_thread(_fault_thread, &_fault_stop, &_fault_done);
+	pthread_join(_fault_thread, NULL);
+
+	// faults the checker has seen the byte after, so they can be classified
+	for (i = 0; i < _fault_log_count; i++)
+		if (_fault_log[i].offset + 1 < _read_count)
+			injected[_fault_log[i].kind]++;
+
+	error_class_flush(_read_count);
+
+	pass = injected[FAULT_DROP] == _class_lost && injected[FAULT_DROP] == _class_lost_bytes &&
+		injected[FAULT_FLIP] == _class_bit_flips && injected[FAULT_INSERT] == _class_inserted &&
+		!_class_corrupt && !_class_other;
+
+	printf("%s: fault link: seed %lld, %lld bytes looped back, %lld checked\n", _cl_port,
+			_cl_fault_seed, _fault_out_bytes, _read_count);
+	printf("%s: fault link: injected drop=%lld flip=%lld insert=%lld delay=%lld stall=%lld\n", _cl_port,
+			injected[FAULT_DROP], injected[FAULT_FLIP], injected[FAULT_INSERT],
+			_fault_events[FAULT_DELAY], _fault_events[FAULT_STALL]);
+	printf("%s: fault link: detected lost=%lld (%lld bytes) bit flips=%lld inserted=%lld corrupt=%lld other=%lld\n",
+			_cl_port, _class_lost, _class_lost_bytes, _class_bit_flips, _class_inserted,
+			_class_corrupt, _class_other);
+	printf("%s: fault link: %s\n", _cl_port, pass ? "PASS" : "FAIL, detected faults do not match injected ones");
+
+	close(_fault_master);
+	free(_fault_log);
+	return pass ? 0 : 1;
+}
+
+/*
+ * Out of band signalling throughput (--signal-bench). A modem line is
+ * toggled with TIOCMBIS/TIOCMBIC, or a break is sent, at increasing rates.
+ * The peer port, wired RTS to CTS, DTR to DSR or DCD and TX to RX (or a
+ * loopback plug on the same port), waits for each event with TIOCMIWAIT, or poll()
+ * for the NUL of a break, and confirms it from its TIOCGICOUNT counters.
+ * The latency of an event is from just before it is sent until the peer
+ * wakes up and counts it. Breaks are framed with TIOCSBRK/TIOCCBRK, held
+ * for half the period, as tcsendbreak() holds them for at least 250ms.
+ */
+#define SIGNAL_SETTLE_MS	200
+
+enum {
+	SIGNAL_RTS,
+	SIGNAL_DTR,
+	SIGNAL_DCD,
+	SIGNAL_BREAK,
+};
+
+// the line toggled and the line the peer sees it on, for the modem lines
+static const int _signal_out[] = { TIOCM_RTS, TIOCM_DTR, TIOCM_DTR };
+static const int _signal_in[] = { TIOCM_CTS, TIOCM_DSR, TIOCM_CD };
+
+static const int _signal_rates[] = { 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000, 20000, 50000 };
+
+static int _signal_kind;
+static int _signal_peer_fd = -1;
+static struct timespec *_signal_sent;
+static int _signal_nsent;
+static double *_signal_lat;
+static int _signal_nlat;
+static volatile int _signal_stop;
+static volatile int _signal_done;
+
+// the peer's count of events of the kind under test
+static int signal_peer_count(void)
+{
+	struct serial_icounter_struct icount = { 0 };
+	int ret;
+
+	if (ioctl(_signal_peer_fd, TIOCGICOUNT, &icount) < 0) {
+		ret = -errno;
+		perror("signal bench: TIOCGICOUNT on peer");
+		exit(ret);
+	}
+	switch (_signal_kind) {
+	case SIGNAL_RTS:
+		return icount.cts;
+	case SIGNAL_DTR:
+		return icount.dsr;
+	case SIGNAL_DCD:
+		return icount.dcd;
+	default:
+		return icount.brk;
+	}
+}
+
+static void signal_peer_seen(int base)
+{
+	struct timespec now;
+	int seen = signal_peer_count() - base;
+	int sent = __atomic_load_n(&_signal_nsent, __ATOMIC_ACQUIRE);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	while (_signal_nlat < seen && _signal_nlat < sent) {
+		_signal_lat[_signal_nlat] = diff_s(&now, &_signal_sent[_signal_nlat]) * 1e6;
+		_signal_nlat++;
+	}
+}
+
+static void *signal_peer_thread(void *arg)
+{
+	int base = *(int *)arg, ret;
+	unsigned char rb[READ_BUFFER_SIZE];
+
+	while (!_signal_stop) {
+		if (_signal_kind == SIGNAL_BREAK) {
+			struct pollfd pfd = { .fd = _signal_peer_fd, .events = POLLIN };
+
+			if (poll(&pfd, 1, 100) <= 0)
+				continue;
+			// the break shows up as a NUL byte, drop it
+			while (read(_signal_peer_fd, rb, sizeof(rb)) > 0)
+				;
 		} else {
-			/* disable RS485 */
-			rs485.flags &= ~(SER_RS485_ENABLED | SER_RS485_RTS_ON_SEND | SER_RS485_RTS_AFTER_SEND);
-			rs485.delay_rts_after_send = 0;
-			rs485.delay_rts_before_send = 0;
-			if (ioctl(_fd, TIOCSRS485, &rs485) < 0) {
-				perror("Error setting RS-232 mode");
+			if (ioctl(_signal_peer_fd, TIOCMIWAIT, _signal_in[_signal_kind]) < 0) {
+				if (errno != EINTR) {
+					ret = -errno;
+					perror("signal bench: TIOCMIWAIT on peer");
+					exit(ret);
+				}
+				continue;
 			}
 		}
+		signal_peer_seen(base);
 	}
+
+	_signal_done = 1;
+	return NULL;
 }
 
-static int diff_ms(const struct timespec *t1, const struct timespec *t2)
+// send one event, returns after the line has been changed back for breaks
+static void signal_send(int i, long long int hold_ns)
 {
-	struct timespec diff;
+	int bit = _signal_out[_signal_kind];
+	int ret;
 
-	diff.tv_sec = t1->tv_sec - t2->tv_sec;
-	diff.tv_nsec = t1->tv_nsec - t2->tv_nsec;
-	if (diff.tv_nsec < 0) {
-		diff.tv_sec--;
-		diff.tv_nsec += 1000000000;
+	clock_gettime(CLOCK_MONOTONIC, &_signal_sent[i]);
+	__atomic_store_n(&_signal_nsent, i + 1, __ATOMIC_RELEASE);
+
+	if (_signal_kind == SIGNAL_BREAK) {
+		struct timespec t = { hold_ns / 1000000000, hold_ns % 1000000000 };
+
+		ret = ioctl(_fd, TIOCSBRK);
+		if (ret == 0) {
+			nanosleep(&t, NULL);
+			ret = ioctl(_fd, TIOCCBRK);
+		}
+	} else {
+		ret = ioctl(_fd, i & 1 ? TIOCMBIC : TIOCMBIS, &bit);
 	}
-	return (diff.tv_sec * 1000 + diff.tv_nsec/1000000);
+
+	if (ret < 0) {
+		ret = -errno;
+		perror("signal bench: sending");
+		exit(ret);
+	}
+}
+
+// run one rate, returns the number of events the peer confirmed
+static int signal_run(int rate, int count, double *achieved)
+{
+	long long int period_ns = 1000000000LL / rate;
+	struct timespec start, next, end;
+	pthread_t peer;
+	int base, i, ret, confirmed;
+
+	if (_signal_kind != SIGNAL_BREAK)
+		set_modem_lines(_fd, 0, _signal_out[_signal_kind]);
+	usleep(SIGNAL_SETTLE_MS * 1000);
+	tcflush(_signal_peer_fd, TCIFLUSH);
+
+	base = signal_peer_count();
+	_signal_nsent = 0;
+	_signal_nlat = 0;
+	_signal_stop = 0;
+	_signal_done = 0;
+
+	ret = pthread_create(&peer, NULL, signal_peer_thread, &base);
+	if (ret) {
+		fprintf(stderr, "ERROR: cannot start signal peer thread: %s\n", strerror(ret));
+		exit(-ret);
+	}
+	// let the peer get into TIOCMIWAIT before the first event
+	usleep(10000);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	next = start;
+	for (i = 0; i < count && !sigint_received; i++) {
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+		signal_send(i, period_ns / 2);
+
+		next.tv_nsec += period_ns;
+		while (next.tv_nsec >= 1000000000) {
+			next.tv_sec++;
+			next.tv_nsec -= 1000000000;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	*achieved = i > 1 ? (i - 1) / diff_s(&end, &start) : 0;
+
+	// wait for the stragglers
+	for (ret = 0; ret < SIGNAL_SETTLE_MS && signal_peer_count() - base < i; ret++)
+		usleep(1000);
+
+	stop_thread(peer, &_signal_stop, &_signal_done);
+	pthread_join(peer, NULL);
+
+	confirmed = signal_peer_count() - base;
+	return confirmed;
 }
 
-static int diff_s(const struct timespec *t1, const struct timespec *t2)
+static int signal_bench(void)
 {
-	return t1->tv_sec - t2->tv_sec;
+	const int nrates = sizeof(_signal_rates) / sizeof(_signal_rates[0]);
+	int count = _cl_signal_count;
+	int best = 0, r, ret;
+
+	if (!strcmp(_cl_signal_bench, "rts")) {
+		_signal_kind = SIGNAL_RTS;
+	} else if (!strcmp(_cl_signal_bench, "dtr")) {
+		_signal_kind = SIGNAL_DTR;
+	} else if (!strcmp(_cl_signal_bench, "dcd")) {
+		_signal_kind = SIGNAL_DCD;
+	} else if (!strcmp(_cl_signal_bench, "break")) {
+		_signal_kind = SIGNAL_BREAK;
+	} else {
+		fprintf(stderr, "ERROR: unknown signal %s, use rts, dtr, dcd or break\n", _cl_signal_bench);
+		exit(-EINVAL);
+	}
+	if (_cl_no_icount || _cl_do_not_touch_modem_lines) {
+		fprintf(stderr, "ERROR: --signal-bench needs TIOCGICOUNT and the modem lines, do not use -n or -m\n");
+		exit(-EINVAL);
+	}
+	// whole toggles, so each rate starts with the line in the same state
+	if (_signal_kind != SIGNAL_BREAK)
+		count += count & 1;
+	if (count <= 0) {
+		fprintf(stderr, "ERROR: --signal-count must be positive\n");
+		exit(-EINVAL);
+	}
+
+	if (_cl_signal_peer) {
+		struct termios tio;
+
+		_signal_peer_fd = open(_cl_signal_peer, O_RDWR | O_NONBLOCK | O_NOCTTY);
+		if (_signal_peer_fd < 0) {
+			ret = -errno;
+			perror("signal bench: opening peer");
+			exit(ret);
+		}
+		// same line settings as the port under test
+		tcgetattr(_fd, &tio);
+		tcsetattr(_signal_peer_fd, TCSANOW, &tio);
+	} else {
+		_signal_peer_fd = _fd;
+	}
+
+	_signal_sent = calloc(count, sizeof(*_signal_sent));
+	_signal_lat = calloc(count, sizeof(*_signal_lat));
+	if (!_signal_sent || !_signal_lat) {
+		fprintf(stderr, "ERROR: Memory allocation failed\n");
+		exit(-ENOMEM);
+	}
+	catch_sigusr2();
+
+	printf("%s: signal bench, %d %s events per rate, peer %s\n", _cl_port, count, _cl_signal_bench,
+			_cl_signal_peer ? _cl_signal_peer : _cl_port);
+	printf("%s: %8s %10s %6s %9s %9s %9s %9s\n", _cl_port, "rate/s", "achieved/s", "sent", "confirmed",
+			"lat p50", "lat p99", "lat max");
+
+	for (r = 0; r < nrates && !sigint_received; r++) {
+		double achieved;
+		int confirmed = signal_run(_signal_rates[r], count, &achieved);
+		double p50 = -1, p99 = -1, max = -1;
+
+		if (_signal_nlat) {
+			qsort(_signal_lat, _signal_nlat, sizeof(*_signal_lat), cmp_double);
+			p50 = _signal_lat[_signal_nlat * 50 / 100];
+			p99 = _signal_lat[_signal_nlat * 99 / 100];
+			max = _signal_lat[_signal_nlat - 1];
+		}
+
+		printf("%s: %8d %10.1f %6d %9d %7.0fus %7.0fus %7.0fus\n", _cl_port, _signal_rates[r], achieved,
+				_signal_nsent, confirmed, p50, p99, max);
+
+		// reliable means every event seen, at the rate asked for
+		if (confirmed != _signal_nsent || achieved < 0.95 * _signal_rates[r])
+			break;
+		best = _signal_rates[r];
+	}
+
+	if (best)
+		printf("%s: max reliable %s rate %d/s\n", _cl_port, _cl_signal_bench, best);
+	else
+		printf("%s: %s events are not reliable even at %d/s\n", _cl_port, _cl_signal_bench, _signal_rates[0]);
+
+	if (_signal_kind != SIGNAL_BREAK)
+		set_modem_lines(_fd, 0, _signal_out[_signal_kind]);
+	if (_cl_signal_peer)
+		close(_signal_peer_fd);
+	free(_signal_sent);
+	free(_signal_lat);
+
+	return best ? 0 : -EIO;
 }
 
 static int compute_error_count(void)
@@ -779,6 +4507,8 @@ static int compute_error_count(void)
 	else
 		result = llabs(_write_count - _read_count) + _error_count;
 
+	result += _line_error_count + _break_count;
+
 	return (result > 125) ? 125 : (int)result;
 }
 
@@ -792,7 +4522,12 @@ int main(int argc, char * argv[])
 
 	process_options(argc, argv);
 
-	int wait_time = _cl_tx_wait;
+	// the default action of SIGUSR1 is to terminate, keep it unless it is used
+	if (_cl_history)
+		signal(SIGUSR1, sigusr1_handler);
+
+	if (_cl_fault_link)
+		fault_link_start();
 
 	if (!_cl_port) {
 		fprintf(stderr, "ERROR: Port argument required\n");
@@ -800,26 +4535,22 @@ int main(int argc, char * argv[])
 		exit(-EINVAL);
 	}
 
-	int baud = B115200;
-
-	if (_cl_baud && !_cl_divisor)
-		baud = get_baud(_cl_baud);
+	if (_cl_baseline_tolerance)
+		baseline_parse_tolerance(_cl_baseline_tolerance);
 
-	if (baud <= 0 || _cl_divisor) {
-		printf("NOTE: non standard baud rate, trying custom divisor\n");
-		baud = B38400;
-		setup_serial_port(B38400);
-		set_baud_divisor(_cl_baud, _cl_divisor);
-	} else {
-		setup_serial_port(baud);
-		/*
-		 * The flag ASYNC_SPD_CUST might have already been set, so
-		 * clear it to avoid confusing the kernel uart dirver.
-		 */
-		clear_custom_speed_flag();
+	// fail before the run, not after it, if the baseline is not there
+	if (_cl_baseline_compare && access(_cl_baseline_compare, R_OK) < 0) {
+		perror("Error reading baseline file");
+		exit(EXIT_BASELINE_UNREADABLE);
 	}
 
-	set_modem_lines(_fd, _cl_loopback ? TIOCM_LOOP : 0, TIOCM_LOOP);
+	if (_cl_open_bench)
+		return open_bench();
+
+	open_serial_port();
+
+	if (_cl_signal_bench)
+		return signal_bench();
 
 	if (_cl_single_byte >= 0) {
 		unsigned char data[2];
@@ -851,21 +4582,42 @@ int main(int argc, char * argv[])
 	}
 
 	if (_cl_ascii_range) {
-		_read_count_value = _write_count_value = 32;
+		_read_count_value = _write_count_value = PATTERN_ASCII_FIRST;
+	}
+
+	if (_cl_payload)
+		map_payload();
+
+	select_kernels();
+
+	if (_cl_wakeup_sweep)
+		return wakeup_sweep();
+
+	enum {
+		POLL_SERIAL,
+		POLL_TX_START,
+		POLL_TX_STOP,
+		POLL_RX_STOP,
+		POLL_FDS,
+	};
+	struct pollfd poll_fds[POLL_FDS];
+	struct pollfd *serial_poll = &poll_fds[POLL_SERIAL];
+	int i;
+
+	for (i = 0; i < POLL_FDS; i++) {
+		poll_fds[i].fd = -1;
+		poll_fds[i].events = POLLIN;
+		poll_fds[i].revents = 0;
 	}
 
-	struct pollfd serial_poll;
-	serial_poll.fd = _fd;
+	serial_poll->fd = _fd;
+	serial_poll->events = 0;
 	if (!_cl_no_rx) {
-		serial_poll.events |= POLLIN;
-	} else {
-		serial_poll.events &= ~POLLIN;
+		serial_poll->events |= POLLIN;
 	}
 
 	if (!_cl_no_tx) {
-		serial_poll.events |= POLLOUT;
-	} else {
-		serial_poll.events &= ~POLLOUT;
+		serial_poll->events |= POLLOUT;
 	}
 
 	if (_cl_flush_buffers) {
@@ -877,40 +4629,62 @@ int main(int argc, char * argv[])
 	}
 
 	struct timespec start_time, last_stat, last_timeout, last_read, last_write;
+	struct run_rate rx_rate = { 0 }, tx_rate = { 0 };
+	int tx_waiting = 0;
 
 	clock_gettime(CLOCK_MONOTONIC, &start_time);
+	_start_time = start_time;
 	last_stat = start_time;
 	last_timeout = start_time;
 	last_read = start_time;
 	last_write = start_time;
 
-	if (_cl_tx_wait)
-		serial_poll.events &= ~POLLOUT;
+	if (_cl_mark_errors)
+		parmrk_init();
+
+	if (_cl_history)
+		history_start(&start_time);
+
+	if (_cl_metrics_socket || _cl_metrics_shm)
+		metrics_start(&start_time);
+
+	if (_cl_tx_wait_ms && !_cl_no_tx) {
+		tx_waiting = 1;
+		serial_poll->events &= ~POLLOUT;
+		poll_fds[POLL_TX_START].fd = start_timer(&start_time, _cl_tx_wait_ms);
+	}
+
+	if (_cl_perf_counters)
+		perf_start();
+
+	if (_cl_load)
+		load_start(&start_time);
+
+	if (_cl_tx_time_ms && !_cl_no_tx)
+		poll_fds[POLL_TX_STOP].fd = start_timer(&start_time, _cl_tx_wait_ms + _cl_tx_time_ms);
+
+	if (_cl_rx_time_ms && !_cl_no_rx)
+		poll_fds[POLL_RX_STOP].fd = start_timer(&start_time, _cl_rx_time_ms);
 
 	while (!(_cl_no_rx && _cl_no_tx) && !sigint_received ) {
 		struct timespec current;
-		int retval = poll(&serial_poll, 1, 1000);
+		int retval = poll(poll_fds, POLL_FDS, 1000);
 
 		clock_gettime(CLOCK_MONOTONIC, &current);
 
-		if (_cl_tx_wait) {
-			if (diff_s(&current, &start_time) >= _cl_tx_wait) {
-				_cl_tx_wait = 0;
-				_cl_no_tx = 0;
-				serial_poll.events |= POLLOUT;
-				printf("Start transmitting.\n");
-			} else {
-				if (!_cl_no_tx) {
-					_cl_no_tx = 1;
-					serial_poll.events &= ~POLLOUT;
-				}
-			}
+		if (retval > 0 && timer_expired(&poll_fds[POLL_TX_START])) {
+			tx_waiting = 0;
+			serial_poll->events |= POLLOUT;
+			last_write = current;
+			printf("Start transmitting.\n");
 		}
 
 		if (retval == -1) {
-			perror("poll()");
+			if (errno != EINTR)
+				perror("poll()");
 		} else if (retval) {
-			if (serial_poll.revents & POLLIN) {
+			if (serial_poll->revents & POLLIN) {
+				perf_switch(PERF_RX);
 				if (_cl_rx_delay) {
 					// only read if it has been rx-delay ms
 					// since the last read
@@ -922,20 +4696,23 @@ int main(int argc, char * argv[])
 					process_read_data();
 					last_read = current;
 				}
+				perf_switch(PERF_OTHER);
 			}
 
-			if (serial_poll.revents & POLLOUT) {
+			if (serial_poll->revents & POLLOUT) {
+				perf_switch(PERF_TX);
 				if (_cl_tx_delay) {
 					// only write if it has been tx-delay ms
 					// since the last write
 					if (diff_ms(&current, &last_write) > _cl_tx_delay) {
-						process_write_data();
+						_tx_kernel();
 						last_write = current;
 					}
 				} else {
-					process_write_data();
+					_tx_kernel();
 					last_write = current;
 				}
+				perf_switch(PERF_OTHER);
 			}
 		}
 
@@ -945,7 +4722,7 @@ int main(int argc, char * argv[])
 
 			// Has it been over two seconds since we transmitted or received data?
 			rx_timeout = (!_cl_no_rx && diff_ms(&current, &last_read) > _cl_rx_timeout_ms);
-			tx_timeout = (!_cl_no_tx && diff_ms(&current, &last_write) > _cl_tx_timeout_ms);
+			tx_timeout = (!_cl_no_tx && !tx_waiting && diff_ms(&current, &last_write) > _cl_tx_timeout_ms);
 			// Special case - we don't want to warn about receive
 			// timeouts at the end of a loopback test (where we are
 			// no longer transmitting and the receive count equals
@@ -980,37 +4757,111 @@ int main(int argc, char * argv[])
 			}
 		}
 
-		if (_cl_stats) {
+		run_rate_update(&rx_rate, _read_count, &current);
+		run_rate_update(&tx_rate, _write_count, &current);
+
+		if (_cl_load && load_update(&current)) {
+			if (!_cl_no_tx) {
+				_cl_no_tx = 1;
+				serial_poll->events &= ~POLLOUT;
+				printf("Stopped transmitting, load ramp done.\n");
+			}
+			// leave a second for the data still on its way
+			if (poll_fds[POLL_RX_STOP].fd < 0 && !_cl_no_rx)
+				poll_fds[POLL_RX_STOP].fd = start_timer(&current, 1000);
+		}
+
+		if (_tx_done && !_cl_no_tx) {
+			_cl_no_tx = 1;
+			serial_poll->events &= ~POLLOUT;
+			printf("Stopped transmitting, all data sent.\n");
+		}
+
+		if (_cl_count && _read_count >= _cl_count && !_cl_no_rx) {
+			_cl_no_rx = 1;
+			serial_poll->events &= ~POLLIN;
+			printf("Stopped receiving, all data received.\n");
+		}
+
+		if (_metrics)
+			metrics_publish(&current);
+
+		if (_cl_history) {
+			history_update(&current);
+			if (history_dump_requested) {
+				history_dump_requested = 0;
+				history_dump();
+			}
+		}
+
+		if (_cl_stats && !_metrics) {
 			if (current.tv_sec - last_stat.tv_sec > 5) {
 				dump_serial_port_stats();
 				last_stat = current;
 			}
 		}
 
-		if (_cl_tx_time && !_cl_tx_wait) {
-			if (current.tv_sec - start_time.tv_sec >= wait_time &&
-				current.tv_sec - start_time.tv_sec - wait_time >= _cl_tx_time ) {
-				_cl_tx_time = 0;
-				_cl_no_tx = 1;
-				serial_poll.events &= ~POLLOUT;
-				printf("Stopped transmitting.\n");
-			}
+		if (retval > 0 && timer_expired(&poll_fds[POLL_TX_STOP]) && !_cl_no_tx) {
+			_cl_no_tx = 1;
+			serial_poll->events &= ~POLLOUT;
+			printf("Stopped transmitting.\n");
 		}
 
-		if (_cl_rx_time) {
-			if (current.tv_sec - start_time.tv_sec >= _cl_rx_time) {
-				_cl_rx_time = 0;
-				_cl_no_rx = 1;
-				serial_poll.events &= ~POLLIN;
-				printf("Stopped receiving.\n");
-			}
+		if (retval > 0 && timer_expired(&poll_fds[POLL_RX_STOP]) && !_cl_no_rx) {
+			_cl_no_rx = 1;
+			serial_poll->events &= ~POLLIN;
+			printf("Stopped receiving.\n");
 		}
 	}
 
+	struct timespec end_time;
+
+	clock_gettime(CLOCK_MONOTONIC, &end_time);
+	for (i = POLL_TX_START; i < POLL_FDS; i++)
+		if (poll_fds[i].fd >= 0)
+			close(poll_fds[i].fd);
+
 	printf("Terminating ...\n");
+	if (_cl_tx_time_ms || _cl_rx_time_ms || _cl_count) {
+		printf("%s: elapsed %.6fs\n", _cl_port, diff_s(&end_time, &start_time));
+		run_rate_print("tx", &tx_rate);
+		run_rate_print("rx", &rx_rate);
+	}
+	perf_stop();
+	load_stop(&end_time);
+	load_report();
 	tcdrain(_fd);
 	dump_serial_port_stats();
+	if (_error_count && !_payload)
+		error_class_print();
 	set_modem_lines(_fd, 0, TIOCM_LOOP); //seems not to be relevant for RTS reset
 
-	return compute_error_count();
+	int ret = compute_error_count();
+
+	// with a fault link errors are expected, what counts is that each was found
+	if (_cl_fault_link)
+		ret = fault_link_report();
+
+	if (_cl_baseline_save || _cl_baseline_compare) {
+		summary_collect(&tx_rate, &rx_rate);
+		if (_cl_baseline_save) {
+			int status = baseline_save(_cl_baseline_save);
+
+			if (!ret)
+				ret = status;
+		}
+		if (_cl_baseline_compare) {
+			int status = baseline_compare(_cl_baseline_compare);
+
+			if (status == EXIT_PERF_REGRESSION)
+				printf("%s: performance regression against %s\n", _cl_port, _cl_baseline_compare);
+			else if (status == EXIT_BASELINE_UNMEASURED)
+				printf("%s: not all metrics of %s were measured\n", _cl_port, _cl_baseline_compare);
+			// data errors take precedence over performance
+			if (!ret)
+				ret = status;
+		}
+	}
+
+	return ret;
 }